@@ -2,220 +2,511 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <windows.h>
+#include <intrin.h>
 
-void initialize_blocks() {
+void initialize_blocks(buddy_head* head) {
 	void* start = head->memStart;
 	int help = head->memSize / BLOCK_SIZE;							
 	int id;
 	while (help > 0) {													
 		id = closest_log(help);
-		block_head* block = (block_head*)start;
-		block->next = NULL;
-		head->entries[id].blocks = block;
+		commitPages(head, start, BLOCK_SIZE);
+		((block_head*)start)->decommitted = head->reserved && !head->largePages;
+		pushBlock(head, (block_head*)start, id);
 		start = (block_head*)((size_t)start + BLOCK_SIZE * (1 << id));
 		help -= (1 << id);
 	}
 }
 
-void initialize_entries(int numOfBlocks) {
-	void* start = head->memStart;
-	int loss = 0;
+void initialize_entries(buddy_head* head) {
+	head->freeMask = 0;
 	for (int i = 0; i < head->NumOfEntries; i++) {
 		head->entries[i].blocks = NULL;
-		head->entries[i].blocks = NULL;
-		head->entries[i].FirstToMerge = start;
-		int s = sizeof(int*) * numOfBlocks / (1 << (i + 1));
-		start = (void*)((size_t)start + s);
-		loss += s;
 	}
 
-	head->memSize -= loss;
-	head->memStart = start;
+	initialize_blocks(head);
+}
 
-	int num = head->memSize / BLOCK_SIZE;
+size_t metaSize(int numOfBlocks) {
+	int numOfEntries = closest_log(numOfBlocks) + 1;
+	size_t meta = sizeof(buddy_head) + PAGE_CACHE_SLOTS * sizeof(page_cache) + numOfEntries * sizeof(entry_head) + numOfBlocks * (sizeof(void*) + sizeof(uint8_t));
+	return (meta + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+}
 
-	for (int i = 0; i < head->NumOfEntries; i++) {
-		start = head->memStart;
-		int j = 0; 
-		
-		while (start < (void*)((size_t)head->start + head->size)) {
-			if (((size_t)start + BLOCK_SIZE * (1 << (i + 1))) <= ((size_t)head->start + head->size)) {
-				head->entries[i].FirstToMerge[j] = start;
-				j = j + 1;
-			}
-			start = (void*)((size_t)start + BLOCK_SIZE * (1 << (i + 1)));
+buddy_head* initialize_head(void* memptr, int numOfBlocks, boolean reserved, boolean largePages, int releaseOrder, int flags) {
+	size_t size = (size_t)numOfBlocks * BLOCK_SIZE;
+	size_t align = (flags & BUDDY_HUGE_PAGES) ? HUGE_PAGE_SIZE : BLOCK_SIZE;
+	size_t memStart = ((size_t)memptr + metaSize(numOfBlocks) + align - 1) / align * align;
+
+	if (memStart + BLOCK_SIZE > (size_t)memptr + size) return NULL;
+
+	int numOfEntries = closest_log(numOfBlocks)+1;
+
+	buddy_head* head = (buddy_head*)memptr;
+	head->start = memptr;
+	head->size = size;
+	head->NumOfEntries = numOfEntries;
+	head->flags = flags;
+	head->reserved = reserved;
+	head->largePages = largePages;
+	head->releaseOrder = reserved ? releaseOrder : numOfEntries;
+	head->caches = (page_cache*)((size_t)memptr + sizeof(buddy_head));
+	head->entries = (entry_head*)((size_t)head->caches + PAGE_CACHE_SLOTS * sizeof(page_cache));
+	head->owners = (void**)((size_t)head->entries + numOfEntries * sizeof(entry_head));
+	head->freeOrder = (uint8_t*)((size_t)head->owners + numOfBlocks * sizeof(void*));
+	head->memStart = (void*)memStart;
+	head->memSize = ((size_t)memptr + size - memStart) / BLOCK_SIZE * BLOCK_SIZE;
+	memset(head->owners, 0, numOfBlocks * sizeof(void*));
+	memset(head->freeOrder, 0, numOfBlocks * sizeof(uint8_t));
+	InitializeCriticalSection(&head->lock);
+
+	for (int k = 0; k < PAGE_CACHE_SLOTS; k++) {
+		for (int i = 0; i < PAGE_CACHE_ORDERS; i++) {
+			head->caches[k].blocks[i] = NULL;
+			head->caches[k].count[i] = 0;
 		}
+		InitializeCriticalSection(&head->caches[k].lock);
 	}
 
-	initialize_blocks();
+	initialize_entries(head);
+
+	return head;
 }
 
-buddy_head* buddy_init(void* memptr, int numOfBlocks)
+buddy_head* buddy_init(void* memptr, int numOfBlocks, int flags)
 {
-	if (!memptr || !numOfBlocks) return NULL;
+	if (!memptr || numOfBlocks <= 0) return NULL;
 
-	size_t size = numOfBlocks*BLOCK_SIZE;
+	return initialize_head(memptr, numOfBlocks, 0, 0, 0, flags);
+}
 
-	if (size < sizeof(buddy_head)) return NULL;
+buddy_head* buddy_reserve(int numOfBlocks, int releaseOrder, int flags)
+{
+	if (numOfBlocks <= 0) return NULL;
 
-	int numOfEntries = closest_log(numOfBlocks)+1;
+	if (flags & BUDDY_HUGE_PAGES) {
+		numOfBlocks += HUGE_PAGE_BLOCKS;
 
-	head = (buddy_head*)memptr;
-	head->start = memptr;
-	head->size = size;
-	head->NumOfEntries = numOfEntries;
-	head->memStart = (void*)((size_t)memptr + numOfEntries * sizeof(entry_head) + sizeof(buddy_head));
+		buddy_head* head = reserveLarge(numOfBlocks, flags);
+		if (head) return head;
+	}
 
-	if (head->memStart > (void*)((size_t)head->start + head->size)) return NULL;
+	void* memptr = VirtualAlloc(NULL, (size_t)numOfBlocks * BLOCK_SIZE, MEM_RESERVE, PAGE_NOACCESS);
 
-	head->memSize = size - ((size_t)numOfEntries * sizeof(entry_head) + sizeof(buddy_head));
-	head->entries = (entry_head*)((size_t)memptr + sizeof(buddy_head));
-	InitializeCriticalSection(&head->lock);
+	if (!memptr) return NULL;
+
+	if (!VirtualAlloc(memptr, metaSize(numOfBlocks), MEM_COMMIT, PAGE_READWRITE)) {
+		VirtualFree(memptr, 0, MEM_RELEASE);
+		return NULL;
+	}
+
+	buddy_head* head = initialize_head(memptr, numOfBlocks, 1, 0, releaseOrder, flags);
 
-	initialize_entries(numOfBlocks);
+	if (!head) {
+		VirtualFree(memptr, 0, MEM_RELEASE);
+	}
 
 	return head;
 }
 
+buddy_head* reserveLarge(int numOfBlocks, int flags) {
+	size_t large = GetLargePageMinimum();
+
+	if (!large) return NULL;
+
+	size_t size = ((size_t)numOfBlocks * BLOCK_SIZE + large - 1) / large * large;
+	void* memptr = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
 
+	if (!memptr) return NULL;
 
-void buddy_destroy()
+	buddy_head* head = initialize_head(memptr, numOfBlocks, 1, 1, closest_log(numOfBlocks) + 1, flags);
+
+	if (!head) {
+		VirtualFree(memptr, 0, MEM_RELEASE);
+		return NULL;
+	}
+
+	return head;
+}
+
+void buddy_destroy(buddy_head* head)
 {
+	for (int k = 0; k < PAGE_CACHE_SLOTS; k++) {
+		DeleteCriticalSection(&head->caches[k].lock);
+	}
 	DeleteCriticalSection(&head->lock);
-	free(head);
-	head = NULL;
+	if (head->reserved) {
+		VirtualFree(head->start, 0, MEM_RELEASE);
+	}
 }
 
-void* getBlock(int i) {
-	void* ret = head->entries[i].blocks;
+void* getBlock(buddy_head* head, int i) {
+	block_head* ret = head->entries[i].blocks;
 	if (ret) {
-		head->entries[i].blocks = head->entries[i].blocks->next;
+		removeBlock(head, ret, i);
 	}
 	return ret;
 }
 
-void* split(void* memory, int min, int max) {
-	while (max > min) {
+boolean commitPages(buddy_head* head, void* memptr, size_t size) {
+	if (!head->reserved || head->largePages) return 1;
+	return VirtualAlloc(memptr, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+}
+
+void releasePages(buddy_head* head, block_head* block, int i) {
+	if (i == 0 || i < head->releaseOrder) return;
+	VirtualFree((void*)((size_t)block + BLOCK_SIZE), ((size_t)BLOCK_SIZE << i) - BLOCK_SIZE, MEM_DECOMMIT);
+	block->decommitted = 1;
+}
+
+boolean commitSplit(buddy_head* head, void* memory, int min, int max) {
+	while (max > min + 1) {
 		max--;
-		insertBlock(memory, max);
-		memory = (size_t)memory + (1 << max) * BLOCK_SIZE;
-		if (max == min) {
-			return memory;
-		}
-		else {
-			split(memory, min, max);
-		}
+		memory = (void*)((size_t)memory + ((size_t)BLOCK_SIZE << max));
+		if (!commitPages(head, memory, BLOCK_SIZE)) return 0;
 	}
+	if (max > min) {
+		memory = (void*)((size_t)memory + ((size_t)BLOCK_SIZE << min));
+	}
+	return commitPages(head, memory, (size_t)BLOCK_SIZE << min);
 }
 
-void* findBlock(int i) {
-	for (int j = i + 1; j < head->NumOfEntries; j++) {
-		if (head->entries[j].blocks) {
-			return split(getBlock(j),i, j);
-		}
+void* split(buddy_head* head, void* memory, int min, int max) {
+	boolean decommitted = ((block_head*)memory)->decommitted;
+	if (decommitted && !commitSplit(head, memory, min, max)) {
+		pushBlock(head, (block_head*)memory, max);
+		return NULL;
 	}
-	return NULL;
+	while (max > min) {
+		max--;
+		((block_head*)memory)->decommitted = decommitted;
+		pushBlock(head, (block_head*)memory, max);
+		memory = (void*)((size_t)memory + ((size_t)BLOCK_SIZE << max));
+	}
+	return memory;
+}
+
+void* findBlock(buddy_head* head, int i) {
+	unsigned long j;
+	uint32_t mask = head->freeMask & ~((1u << i) - 1);
+	if (!_BitScanForward(&j, mask)) return NULL;
+	return split(head, getBlock(head, j), i, j);
+}
+
+void* allocate(buddy_head* head, int i) {
+	return findBlock(head, i);
 }
 
-void* allocate(int i) {
+void* buddy_alloc(buddy_head* head, size_t memsize)
+{
 	void* ret = NULL;
-	ret = getBlock(i);
+	size_t help = ceil((double)memsize / BLOCK_SIZE);
+	int id = block_size(help);
+
+	if (id >= head->NumOfEntries) return NULL;
+
+	if (id < PAGE_CACHE_ORDERS) {
+		ret = cacheAlloc(head, id);
+	}
+	else {
+		EnterCriticalSection(&head->lock);
+		ret = allocate(head, id);
+		LeaveCriticalSection(&head->lock);
+	}
+
 	if (!ret) {
-		ret = findBlock(i);
+		buddy_drain(head);
+		EnterCriticalSection(&head->lock);
+		ret = allocate(head, id);
+		LeaveCriticalSection(&head->lock);
 	}
+
 	return ret;
 }
 
-void* buddy_alloc(size_t memsize)
+void* buddy_alloc_near(buddy_head* head, size_t memsize, void* hint)
 {
-	void* ret = NULL;
 	size_t help = ceil((double)memsize / BLOCK_SIZE);
 	int id = block_size(help);
+	void* ret = NULL;
+
+	if (!(head->flags & BUDDY_HUGE_PAGES) || !hint || id >= HUGE_PAGE_ORDER) return buddy_alloc(head, memsize);
+	if (hint < head->memStart || hint >= (void*)((size_t)head->memStart + head->memSize)) return buddy_alloc(head, memsize);
+
+	EnterCriticalSection(&head->lock);
+	ret = findNear(head, id, hint);
+	LeaveCriticalSection(&head->lock);
+
+	if (!ret) {
+		ret = buddy_alloc(head, memsize);
+	}
+
+	return ret;
+}
 
-	if (id <= head->NumOfEntries)
-	{
+void* findNear(buddy_head* head, int i, void* hint) {
+	size_t first = blockIndex(head, hint) / HUGE_PAGE_BLOCKS * HUGE_PAGE_BLOCKS;
+	size_t last = first + HUGE_PAGE_BLOCKS;
+	if (last > head->memSize / BLOCK_SIZE) {
+		last = head->memSize / BLOCK_SIZE;
+	}
+	for (size_t k = first; k < last; k += (size_t)1 << i) {
+		int order = head->freeOrder[k] - 1;
+		if (order >= i) {
+			block_head* block = (block_head*)((size_t)head->memStart + k * BLOCK_SIZE);
+			removeBlock(head, block, order);
+			return split(head, block, i, order);
+		}
+	}
+	return NULL;
+}
+
+page_cache* localCache(buddy_head* head) {
+	return &head->caches[thread_slot() % PAGE_CACHE_SLOTS];
+}
+
+void* cacheAlloc(buddy_head* head, int i) {
+	page_cache* cache = localCache(head);
+	EnterCriticalSection(&cache->lock);
+	if (!cache->blocks[i]) {
 		EnterCriticalSection(&head->lock);
-		ret = allocate(id);
+		for (int k = 0; k < (PAGE_CACHE_BATCH >> i); k++) {
+			block_head* block = allocate(head, i);
+			if (!block) break;
+			block->next = cache->blocks[i];
+			cache->blocks[i] = block;
+			cache->count[i]++;
+		}
 		LeaveCriticalSection(&head->lock);
 	}
-
+	block_head* ret = cache->blocks[i];
+	if (ret) {
+		cache->blocks[i] = ret->next;
+		cache->count[i]--;
+	}
+	LeaveCriticalSection(&cache->lock);
 	return ret;
 }
 
+void cacheFree(buddy_head* head, void* memptr, int i) {
+	page_cache* cache = localCache(head);
+	block_head* block = (block_head*)memptr;
+	EnterCriticalSection(&cache->lock);
+	block->next = cache->blocks[i];
+	cache->blocks[i] = block;
+	cache->count[i]++;
+	if (cache->count[i] > (PAGE_CACHE_HIGH >> i)) {
+		drainCache(head, cache, i, PAGE_CACHE_BATCH >> i);
+	}
+	LeaveCriticalSection(&cache->lock);
+}
 
+void drainCache(buddy_head* head, page_cache* cache, int i, int num) {
+	EnterCriticalSection(&head->lock);
+	while (num-- > 0 && cache->blocks[i]) {
+		block_head* block = cache->blocks[i];
+		cache->blocks[i] = block->next;
+		cache->count[i]--;
+		insertBlock(head, block, i);
+	}
+	LeaveCriticalSection(&head->lock);
+}
 
-void removeBlock(block_head* memptr, int i) {
-	block_head* curr = head->entries[i].blocks, * prev = NULL;
-	while (curr != memptr) {									
-		prev = curr;
-		curr = curr->next;
+void buddy_drain(buddy_head* head)
+{
+	for (int k = 0; k < PAGE_CACHE_SLOTS; k++) {
+		page_cache* cache = &head->caches[k];
+		EnterCriticalSection(&cache->lock);
+		for (int i = 0; i < PAGE_CACHE_ORDERS; i++) {
+			if (cache->count[i]) {
+				drainCache(head, cache, i, cache->count[i]);
+			}
+		}
+		LeaveCriticalSection(&cache->lock);
+	}
+}
+
+
+
+size_t blockIndex(buddy_head* head, const void* memptr) {
+	return ((size_t)memptr - (size_t)head->memStart) / BLOCK_SIZE;
+}
+
+void pushBlock(buddy_head* head, block_head* memptr, int i) {
+	memptr->prev = NULL;
+	memptr->next = head->entries[i].blocks;
+	if (memptr->next) {
+		memptr->next->prev = memptr;
 	}
-	if (prev) {
-		prev->next = curr->next;
+	head->entries[i].blocks = memptr;
+	head->freeOrder[blockIndex(head, memptr)] = i + 1;
+	head->freeMask |= 1u << i;
+}
+
+void removeBlock(buddy_head* head, block_head* memptr, int i) {
+	if (memptr->prev) {
+		memptr->prev->next = memptr->next;
 	}
 	else {
 		head->entries[i].blocks = memptr->next;
+		if (!memptr->next) {
+			head->freeMask &= ~(1u << i);
+		}
+	}
+	if (memptr->next) {
+		memptr->next->prev = memptr->prev;
 	}
-	memptr->next = NULL;
+	memptr->next = memptr->prev = NULL;
+	head->freeOrder[blockIndex(head, memptr)] = 0;
 }
 
-int* findPair(int* memptr, int i) {
-	int numOfBlocks = head->memSize / BLOCK_SIZE;
-	for (int k = 0; k < (numOfBlocks / (1 << (i + 1))); k++) {
-		if ((head->entries[i].FirstToMerge[k] + BLOCK_SIZE * (1 << i)) == memptr) {
-			return (int*)(head->entries[i].FirstToMerge[k]);
-		}
-		if (head->entries[i].FirstToMerge[k] == memptr) {
-			return (int*)(head->entries[i].FirstToMerge[k] + BLOCK_SIZE * (1 << i));
+block_head* findPair(buddy_head* head, void* memptr, int i) {
+	size_t size = (size_t)BLOCK_SIZE << i;
+	size_t pair = ((size_t)memptr - (size_t)head->memStart) ^ size;
+	if (pair + size > head->memSize) return NULL;
+	return (block_head*)((size_t)head->memStart + pair);
+}
+
+block_head* findAddr(buddy_head* head, block_head* memptr, int i) {
+	if (head->freeOrder[blockIndex(head, memptr)] != i + 1) return NULL;
+	return memptr;
+}
+
+void insertBlock(buddy_head* head, void* memptr, int i) {
+	block_head* pair;
+	boolean decommitted = 0;
+	while (i + 1 < head->NumOfEntries && (pair = findPair(head, memptr, i)) && findAddr(head, pair, i)) {
+		removeBlock(head, pair, i);
+		decommitted |= pair->decommitted;
+		if ((void*)pair < memptr) {
+			memptr = pair;
 		}
+		i++;
 	}
-	return NULL;
+	((block_head*)memptr)->decommitted = decommitted;
+	pushBlock(head, (block_head*)memptr, i);
+	releasePages(head, (block_head*)memptr, i);
 }
 
-block_head* findAddr(int* memptr, int i) {
-	block_head* curr = head->entries[i].blocks;
-	while (curr && curr != (block_head*)memptr) {
-		curr = curr->next;
+void buddy_free(buddy_head* head, void* memptr, size_t memSize)
+{
+	if (memptr < head->memStart || memptr >= (void*)((size_t)head->memStart + head->memSize)) return;
+	size_t help = ceil((double)memSize / BLOCK_SIZE);
+	int numOfBlocks = block_size(help);
+	if (numOfBlocks < PAGE_CACHE_ORDERS) {
+		cacheFree(head, memptr, numOfBlocks);
+		return;
+	}
+	EnterCriticalSection(&head->lock);
+	insertBlock(head, memptr, numOfBlocks);
+	LeaveCriticalSection(&head->lock);
+}
+
+void* buddy_alloc_exact(buddy_head* head, size_t memsize)
+{
+	void* ret = buddy_alloc(head, memsize);
+	if (ret) {
+		buddy_trim(head, ret, memsize);
 	}
-	return curr;
+	return ret;
+}
+
+void buddy_trim(buddy_head* head, void* memptr, size_t memsize)
+{
+	size_t num = ceil((double)memsize / BLOCK_SIZE);
+	size_t end = (size_t)1 << block_size(num);
+	if (num == end) return;
+	EnterCriticalSection(&head->lock);
+	freeRange(head, (void*)((size_t)memptr + num * BLOCK_SIZE), end - num);
+	LeaveCriticalSection(&head->lock);
 }
 
-void insertBlock(void* memptr, int i) {
-	int* pair = findPair(memptr, i);
-	if (pair && findAddr(pair, i)) {
-		removeBlock((block_head*)pair, i);
-		if (pair > (int*)memptr) {
-			insertBlock(memptr, i + 1);
+void freeRange(buddy_head* head, void* memptr, size_t num) {
+	size_t k = blockIndex(head, memptr);
+	size_t end = k + num;
+	while (k < end) {
+		int i = 0;
+		while (i + 1 < head->NumOfEntries && !(k & ((size_t)1 << i)) && k + ((size_t)2 << i) <= end) {
+			i++;
 		}
-		else {
-			insertBlock(pair, i + 1);
+		insertBlock(head, (void*)((size_t)head->memStart + k * BLOCK_SIZE), i);
+		k += (size_t)1 << i;
+	}
+}
+
+void buddy_free_exact(buddy_head* head, void* memptr, size_t memSize)
+{
+	if (memptr < head->memStart || memptr >= (void*)((size_t)head->memStart + head->memSize)) return;
+	size_t num = ceil((double)memSize / BLOCK_SIZE);
+	if (!(num & (num - 1)) && !(blockIndex(head, memptr) & (num - 1))) {
+		buddy_free(head, memptr, memSize);
+		return;
+	}
+	EnterCriticalSection(&head->lock);
+	freeRange(head, memptr, num);
+	LeaveCriticalSection(&head->lock);
+}
+
+boolean buddy_extend(buddy_head* head, void* memptr, size_t oldSize, size_t newSize)
+{
+	size_t from = blockIndex(head, memptr) + (size_t)ceil((double)oldSize / BLOCK_SIZE);
+	size_t to = blockIndex(head, memptr) + (size_t)ceil((double)newSize / BLOCK_SIZE);
+	if (from >= to) return 1;
+	if (to > head->memSize / BLOCK_SIZE) return 0;
+
+	EnterCriticalSection(&head->lock);
+	size_t start;
+	for (size_t k = from; k < to; ) {
+		int i = findFree(head, k, &start);
+		if (i < 0) {
+			LeaveCriticalSection(&head->lock);
+			return 0;
 		}
+		k = start + ((size_t)1 << i);
 	}
-	else {
-		if (!head->entries[i].blocks) {
-			head->entries[i].blocks = (block_head*)memptr;
-			head->entries[i].blocks->next = NULL;
+	for (size_t k = from; k < to; ) {
+		int i = findFree(head, k, &start);
+		size_t end = start + ((size_t)1 << i);
+		block_head* block = (block_head*)((size_t)head->memStart + start * BLOCK_SIZE);
+		removeBlock(head, block, i);
+		if (block->decommitted && !commitPages(head, block, (size_t)BLOCK_SIZE << i)) {
+			pushBlock(head, block, i);
+			if (k > from) freeRange(head, (block_head*)((size_t)head->memStart + from * BLOCK_SIZE), k - from);
+			LeaveCriticalSection(&head->lock);
+			return 0;
 		}
-		else {
-			block_head* prev = NULL, * curr = head->entries[i].blocks;
-			while (curr) {
-				prev = curr;
-				curr = curr->next;
-			}
-			prev->next = (block_head*)memptr;
-			prev->next->next = NULL;
+		if (start < k) freeRange(head, block, k - start);
+		if (end > to) freeRange(head, (block_head*)((size_t)head->memStart + to * BLOCK_SIZE), end - to);
+		k = end;
+	}
+	LeaveCriticalSection(&head->lock);
+	return 1;
+}
+
+int findFree(buddy_head* head, size_t k, size_t* start) {
+	for (int i = 0; i < head->NumOfEntries; i++) {
+		size_t s = k & ~(((size_t)1 << i) - 1);
+		if (head->freeOrder[s] == i + 1) {
+			*start = s;
+			return i;
 		}
 	}
+	return -1;
 }
 
-void buddy_free(void* memptr, size_t memSize)
+void buddy_set_owner(buddy_head* head, void* memptr, size_t memsize, void* owner)
 {
-	EnterCriticalSection(&head->lock);
-	if (memptr < head->start || memptr>(void*)((size_t)head->start + head->size)) return NULL;
-	size_t help = ceil((double)memSize / BLOCK_SIZE);
-	int numOfBlocks = block_size(help);
-	insertBlock(memptr, numOfBlocks);
-	LeaveCriticalSection(&head->lock);
+	size_t first = blockIndex(head, memptr);
+	size_t last = first + (size_t)ceil((double)memsize / BLOCK_SIZE);
+	for (size_t k = first; k < last; k++) {
+		head->owners[k] = owner;
+	}
 }
 
+void* buddy_owner(buddy_head* head, const void* memptr)
+{
+	if (memptr < head->memStart || memptr >= (void*)((size_t)head->memStart + head->memSize)) return NULL;
+	return head->owners[blockIndex(head, memptr)];
+}
@@ -6,16 +6,32 @@
 #include "global.h"
 
 #define BLOCK_SIZE 4096
+#define PAGE_CACHE_ORDERS 4
+#define PAGE_CACHE_SLOTS 64
+#define PAGE_CACHE_HIGH 32
+#define PAGE_CACHE_BATCH 16
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define HUGE_PAGE_BLOCKS (HUGE_PAGE_SIZE / BLOCK_SIZE)
+#define HUGE_PAGE_ORDER 9
+
+#define BUDDY_HUGE_PAGES 1
 
 typedef struct Block_Head_Struct {
 	struct Block_Head_Struct* next;
+	struct Block_Head_Struct* prev;
+	boolean decommitted;
 } block_head;
 
 typedef struct Entry_Head_Stuct {
 	block_head* blocks;
-	int* FirstToMerge;
 } entry_head;
 
+typedef struct Page_Cache_Struct {
+	CRITICAL_SECTION lock;
+	block_head* blocks[PAGE_CACHE_ORDERS];
+	int count[PAGE_CACHE_ORDERS];
+} page_cache;
+
 typedef struct Buddy_Head_Struct {
 	size_t size;
 	void* start;
@@ -23,36 +39,89 @@ typedef struct Buddy_Head_Struct {
 	void* memStart;
 	int NumOfEntries;
 	entry_head* entries;
+	page_cache* caches;
+	void** owners;
+	uint8_t* freeOrder;
+	uint32_t freeMask;
+	int flags;
+	boolean reserved;
+	boolean largePages;
+	int releaseOrder;
 	CRITICAL_SECTION lock;
 } buddy_head;
 
-buddy_head* head;
+void initialize_blocks(buddy_head* head);
+
+void initialize_entries(buddy_head* head);
+
+size_t metaSize(int numOfBlocks);
+
+buddy_head* initialize_head(void* memptr, int numOfBlocks, boolean reserved, boolean largePages, int releaseOrder, int flags);
+
+buddy_head* buddy_init(void* memptr, int numOfBlocks, int flags);
+
+buddy_head* buddy_reserve(int numOfBlocks, int releaseOrder, int flags); // Reserve address space, commit on demand, decommit free blocks of releaseOrder and above
+
+buddy_head* reserveLarge(int numOfBlocks, int flags);
+
+void buddy_destroy(buddy_head* head);
+
+void* getBlock(buddy_head* head, int i);
+
+boolean commitPages(buddy_head* head, void* memptr, size_t size);
+
+void releasePages(buddy_head* head, block_head* block, int i);
+
+boolean commitSplit(buddy_head* head, void* memory, int min, int max);
+
+void* split(buddy_head* head, void* memptr, int min, int max);
+
+void* findBlock(buddy_head* head, int i);
+
+void* allocate(buddy_head* head, int i);
+
+void* buddy_alloc(buddy_head* head, size_t memsize);
+
+void* buddy_alloc_near(buddy_head* head, size_t memsize, void* hint); // Prefer a block in the same huge page as hint
+
+void* findNear(buddy_head* head, int i, void* hint);
+
+page_cache* localCache(buddy_head* head);
+
+void* cacheAlloc(buddy_head* head, int i);
+
+void cacheFree(buddy_head* head, void* memptr, int i);
+
+void drainCache(buddy_head* head, page_cache* cache, int i, int num);
+
+void buddy_drain(buddy_head* head);
 
-void initialize_blocks();
+size_t blockIndex(buddy_head* head, const void* memptr);
 
-void initialize_entries(int numOfBlocks);
+void pushBlock(buddy_head* head, block_head* memptr, int i);
 
-buddy_head* buddy_init(void* memptr, int numOfBlocks);
+void removeBlock(buddy_head* head, block_head* memptr, int i);
 
-void buddy_destroy();
+block_head* findPair(buddy_head* head, void* memptr, int i);
 
-void* getBlock(int i);
+block_head* findAddr(buddy_head* head, block_head* memptr, int i);
 
-void* split(void* memptr, int min, int max);
+void insertBlock(buddy_head* head, void* memptr, int i);
 
-void* findBlock(int i);
+void buddy_free(buddy_head* head, void* memptr, size_t memSize);
 
-void* allocate(int i);
+void* buddy_alloc_exact(buddy_head* head, size_t memsize); // Allocate exactly ceil(memsize / BLOCK_SIZE) blocks
 
-void* buddy_alloc(size_t memsize);
+void buddy_trim(buddy_head* head, void* memptr, size_t memsize); // Return the tail of a rounded block past memsize
 
-void removeBlock(block_head* memptr, int i);
+void freeRange(buddy_head* head, void* memptr, size_t num);
 
-int* findPair(int* memptr, int i);
+void buddy_free_exact(buddy_head* head, void* memptr, size_t memSize);
 
-block_head* findAddr(int* memptr, int i);
+boolean buddy_extend(buddy_head* head, void* memptr, size_t oldSize, size_t newSize); // Grow an allocation in place by claiming the free blocks after it
 
-void insertBlock(void* memptr, int i);
+int findFree(buddy_head* head, size_t k, size_t* start);
 
-void buddy_free(void* memptr, size_t memSize);
+void buddy_set_owner(buddy_head* head, void* memptr, size_t memsize, void* owner); // Tag every block of an allocation with its owner
 
+void* buddy_owner(buddy_head* head, const void* memptr); // Owner of the block containing memptr
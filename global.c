@@ -1,6 +1,16 @@
 
 #include "global.h"
+#include <windows.h>
 
+static __declspec(thread) int slot = -1;
+static volatile LONG numOfSlots = 0;
+
+int thread_slot() {
+	if (slot < 0) {
+		slot = InterlockedIncrement(&numOfSlots) - 1;
+	}
+	return slot;
+}
 
 int closest_log(int num) {
 	int cnt = -1;
@@ -20,22 +30,6 @@ int block_size(int par) {
 }
 
 
-size_t slab_size(size_t size) {
-	size_t ret = 0;
-	if (size > BLOCK_SIZE) {
-
-		size = ceil((double)size / BLOCK_SIZE);
-
-		size_t help = size;
-		uint8_t cnt = -1;
-		while (help > 0) {
-			cnt = cnt + 1;
-			help >>= 1;
-		}
-		if ((size - (1 << cnt)) != 0) {
-			cnt += 1;
-		}
-		ret = cnt;
-	}
-	return 1 << ret;
-}
\ No newline at end of file
+size_t align_up(size_t value, size_t align) {
+	return (value + align - 1) & ~(align - 1);
+}
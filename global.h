@@ -9,6 +9,8 @@
 
 int closest_log(int num);
 
+int thread_slot();
+
 int block_size(int par);
 
-size_t slab_size(size_t size);
\ No newline at end of file
+size_t align_up(size_t value, size_t align);
\ No newline at end of file
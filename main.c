@@ -2,12 +2,29 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 #include "slab.h"
 #include "test.h"
 
 #define BLOCK_NUMBER (1000)
 #define THREAD_NUM (5)
 #define ITERATIONS (1000)
+#define BATCH (64)
+
+#define CHURN_SIZE (64)
+#define CHURN_LIVE (2000)
+#define CHURN_OPS (200000)
+#define CHURN_REPORT (20000)
+
+#define COLOR_SIZE (300)
+#define COLOR_CACHES (64)
+#define COLOR_SLABS (5)
+#define COLOR_ROUNDS (8000)
+
+#define CHASE_BLOCKS (16384)
+#define CHASE_CACHES (8)
+#define CHASE_OBJECTS (200000)
+#define CHASE_STEPS (10000000)
 
 #define shared_size (7)
 
@@ -69,7 +86,182 @@ void work(void* pdata) {
 	kmem_cache_destroy(cache);
 }
 
-int main() {
+void work_bulk(void* pdata) {
+	struct data_s data = *(struct data_s*) pdata;
+	char buffer[1024];
+	sprintf_s(buffer, 1024, "bulk cache %d", data.id);
+	kmem_cache_t *cache = kmem_cache_create(buffer, data.id, 0, 0);
+
+	void **objs = (void**)(kmalloc(sizeof(void*) * data.iterations));
+
+	for (int i = 0; i < data.iterations; i += BATCH) {
+		int num = (data.iterations - i < BATCH) ? data.iterations - i : BATCH;
+		assert(kmem_cache_alloc_bulk(cache, num, objs + i) == num);
+		for (int j = i; j < i + num; j++) {
+			memset(objs[j], MASK, data.id);
+		}
+	}
+
+	kmem_cache_info(cache);
+
+	for (int i = 0; i < data.iterations; i += BATCH) {
+		int num = (data.iterations - i < BATCH) ? data.iterations - i : BATCH;
+		for (int j = i; j < i + num; j++) {
+			assert(check(objs[j], data.id));
+		}
+		kmem_cache_free_bulk(cache, num, objs + i);
+	}
+
+	kfree(objs);
+	kmem_cache_destroy(cache);
+}
+
+void churn_report(kmem_cache_t* cache, int ops) {
+	kmem_stats_t table[64];
+	kmem_cache_shrink(cache);
+	int num = kmem_stats_snapshot(table, 64);
+	for (int i = 0; i < num && i < 64; i++) {
+		if (table[i].name == cache->name) {
+			size_t perSlab = table[i].numSlabs ? table[i].totalObjects / table[i].numSlabs : 1;
+			printf_s("churn ops: %d live: %zu slabs: %zu ideal: %zu\n", ops, table[i].activeObjects, table[i].numSlabs, (table[i].activeObjects + perSlab - 1) / perSlab);
+		}
+	}
+}
+
+void churn() {
+	kmem_cache_t *cache = kmem_cache_create_aligned("churn", CHURN_SIZE, 0, SLAB_NO_MERGE, NULL, NULL);
+	kmem_cache_set_magazine(cache, 0);
+
+	void **objs = (void**)(kmalloc(sizeof(void*) * CHURN_LIVE * 2));
+	int size = 0;
+	srand(1);
+
+	while (size < CHURN_LIVE * 2) {
+		objs[size++] = kmem_cache_alloc(cache);
+	}
+	while (size > CHURN_LIVE) {
+		int i = rand() % size;
+		kmem_cache_free(cache, objs[i]);
+		objs[i] = objs[--size];
+	}
+	churn_report(cache, 0);
+
+	for (int ops = 1; ops <= CHURN_OPS; ops++) {
+		if (size > CHURN_LIVE / 2 && (size == CHURN_LIVE * 2 || rand() % 2)) {
+			int i = rand() % size;
+			kmem_cache_free(cache, objs[i]);
+			objs[i] = objs[--size];
+		}
+		else {
+			objs[size++] = kmem_cache_alloc(cache);
+		}
+		if (ops % CHURN_REPORT == 0) {
+			churn_report(cache, ops);
+		}
+	}
+
+	for (int i = 0; i < size; i++) {
+		kmem_cache_free(cache, objs[i]);
+	}
+	kfree(objs);
+	kmem_cache_destroy(cache);
+}
+
+void color_walk(int colored, const char *label) {
+	kmem_cache_t *caches[COLOR_CACHES];
+	char buffer[1024];
+	for (int i = 0; i < COLOR_CACHES; i++) {
+		sprintf_s(buffer, 1024, "color cache %d", i);
+		caches[i] = kmem_cache_create_aligned(buffer, COLOR_SIZE, 0, SLAB_NO_MERGE, NULL, NULL);
+		if (!colored) kmem_cache_set_color(caches[i], 0);
+	}
+
+	int slots = (int)caches[0]->layout.numOfSlots;
+	int perCache = slots * COLOR_SLABS;
+	void **objs = (void**)(kmalloc(sizeof(void*) * perCache * COLOR_CACHES));
+	for (int i = 0; i < COLOR_CACHES; i++) {
+		for (int j = 0; j < perCache; j++) {
+			objs[i * perCache + j] = kmem_cache_alloc(caches[i]);
+			memset(objs[i * perCache + j], MASK, COLOR_SIZE);
+		}
+	}
+
+	size_t sum = 0;
+	clock_t begin = clock();
+	for (int r = 0; r < COLOR_ROUNDS; r++) {
+		for (int j = 0; j < slots; j++) {
+			for (int i = 0; i < COLOR_CACHES; i++) {
+				for (int k = 0; k < COLOR_SLABS; k++) {
+					sum += *(unsigned char*)objs[i * perCache + k * slots + j];
+				}
+			}
+		}
+	}
+	printf_s("color %s: %ld ms\n", label, (long)((clock() - begin) * 1000 / CLOCKS_PER_SEC));
+	assert(sum == (size_t)MASK * COLOR_ROUNDS * perCache * COLOR_CACHES);
+
+	for (int i = 0; i < COLOR_CACHES; i++) {
+		for (int j = 0; j < perCache; j++) {
+			kmem_cache_free(caches[i], objs[i * perCache + j]);
+		}
+		kmem_cache_destroy(caches[i]);
+	}
+	kfree(objs);
+}
+
+int chase_rand(int bound) {
+	return (int)(((unsigned)rand() * (RAND_MAX + 1u) + (unsigned)rand()) % (unsigned)bound);
+}
+
+void chase(int flags, const char *label) {
+	void *space = malloc((size_t)BLOCK_SIZE * CHASE_BLOCKS);
+	kmem_init_arenas(space, CHASE_BLOCKS, NUM_OF_ARENAS, flags);
+
+	kmem_cache_t *caches[CHASE_CACHES];
+	char buffer[1024];
+	for (int i = 0; i < CHASE_CACHES; i++) {
+		sprintf_s(buffer, 1024, "chase cache %d", i);
+		caches[i] = kmem_cache_create(buffer, sizeof(void*) * (i + 2), NULL, NULL);
+	}
+
+	void **objs = (void**)(kmalloc(sizeof(void*) * CHASE_OBJECTS));
+	int *order = (int*)(kmalloc(sizeof(int) * CHASE_OBJECTS));
+	for (int i = 0; i < CHASE_OBJECTS; i++) {
+		objs[i] = kmem_cache_alloc(caches[i % CHASE_CACHES]);
+		order[i] = i;
+	}
+
+	srand(1);
+	for (int i = CHASE_OBJECTS - 1; i > 0; i--) {
+		int j = chase_rand(i + 1);
+		int tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	for (int i = 0; i < CHASE_OBJECTS; i++) {
+		*(void**)objs[order[i]] = objs[order[(i + 1) % CHASE_OBJECTS]];
+	}
+
+	void *p = objs[order[0]];
+	clock_t begin = clock();
+	for (int i = 0; i < CHASE_STEPS; i++) {
+		p = *(void**)p;
+	}
+	printf_s("chase %s: %ld ms\n", label, (long)((clock() - begin) * 1000 / CLOCKS_PER_SEC));
+	assert(p);
+
+	for (int i = 0; i < CHASE_OBJECTS; i++) {
+		kmem_cache_free(caches[i % CHASE_CACHES], objs[i]);
+	}
+	kfree(order);
+	kfree(objs);
+	for (int i = 0; i < CHASE_CACHES; i++) {
+		kmem_cache_destroy(caches[i]);
+	}
+	free(space);
+}
+
+int main() { setvbuf(stdout, NULL, _IONBF, 0);
 	void *space = malloc(BLOCK_SIZE * BLOCK_NUMBER);
 	kmem_init(space, BLOCK_NUMBER);
 	kmem_cache_t *shared = kmem_cache_create("shared object", shared_size, construct, NULL);
@@ -77,9 +269,24 @@ int main() {
 	struct data_s data;
 	data.shared = shared;
 	data.iterations = ITERATIONS;
+
+	clock_t begin = clock();
 	run_threads(work, &data, THREAD_NUM);
+	printf_s("work: %ld ms\n", (long)((clock() - begin) * 1000 / CLOCKS_PER_SEC));
+
+	begin = clock();
+	run_threads(work_bulk, &data, THREAD_NUM);
+	printf_s("work_bulk: %ld ms\n", (long)((clock() - begin) * 1000 / CLOCKS_PER_SEC));
+
+	churn();
+
+	color_walk(0, "off");
+	color_walk(1, "default");
 
 	kmem_cache_destroy(shared);
 	free(space);
+
+	chase(0, "4K");
+	chase(BUDDY_HUGE_PAGES, "huge");
 	return 0;
 }
@@ -3,16 +3,73 @@
 #include <string.h>
 #include <stdio.h>
 
+static __declspec(thread) int boundArena = -1;
+static __declspec(thread) boolean inReclaim = 0;
+static __declspec(thread) int noReclaim = 0; // Allocator lock held or retry in progress, reclaim is left to the outermost caller
+static char bufferNames[NUM_BUFFER_CACHES][16];
+static uint8_t sizeIndex[SMALL_CLASS_LIMIT / 8];
+
 void kmem_init(void* space, int block_num)
 {
-	buddy = buddy_init(space, block_num);
+	kmem_init_arenas(space, block_num, NUM_OF_ARENAS, 0);
+}
 
-	if (!buddy) {
-		printf_s("Not enough memmory to initialize buddy\n");
-		return;
+int arena_count(int block_num, int num_arenas) {
+	if (num_arenas > MAX_ARENAS) num_arenas = MAX_ARENAS;
+	if (num_arenas > block_num / MIN_ARENA_BLOCKS) num_arenas = block_num / MIN_ARENA_BLOCKS;
+	if (num_arenas < 1) num_arenas = 1;
+	return num_arenas;
+}
+
+void kmem_init_arenas(void* space, int block_num, int num_arenas, int flags)
+{
+	num_arenas = arena_count(block_num, num_arenas);
+
+	int blocks = block_num / num_arenas;
+	numOfArenas = 0;
+	for (int i = 0; i < num_arenas; i++) {
+		int num = (i == num_arenas - 1) ? block_num - i * blocks : blocks;
+		arenas[i] = buddy_init((void*)((size_t)space + (size_t)i * blocks * BLOCK_SIZE), num, flags);
+
+		if (!arenas[i]) {
+			printf_s("Not enough memmory to initialize buddy\n");
+			return;
+		}
+		numOfArenas++;
 	}
 
-	buffer_cache = buddy_alloc(sizeof(buffer_cache_t)*(MAX_BUFFER_SIZE-MIN_BUFFER_SIZE+1)+sizeof(kmem_cache_t));
+	initialize_kmem();
+}
+
+void kmem_init_reserved(int block_num, int num_arenas, int release_order, int flags)
+{
+	num_arenas = arena_count(block_num, num_arenas);
+
+	int blocks = block_num / num_arenas;
+	numOfArenas = 0;
+	for (int i = 0; i < num_arenas; i++) {
+		int num = (i == num_arenas - 1) ? block_num - i * blocks : blocks;
+		arenas[i] = buddy_reserve(num, release_order, flags);
+
+		if (!arenas[i]) {
+			printf_s("Not enough address space to reserve buddy\n");
+			return;
+		}
+		numOfArenas++;
+	}
+
+	initialize_kmem();
+}
+
+void initialize_kmem() {
+	cacheList = NULL;
+	for (int i = 0; i < MAX_SHRINKERS; i++) {
+		shrinkers[i].shrink = NULL;
+	}
+	InitializeCriticalSection(&cacheListLock);
+
+	size_t objectCacheOffset = align_up(sizeof(buffer_cache_t) * NUM_BUFFER_CACHES, CACHE_L1_LINE_SIZE);
+	buffer_cache = arena_alloc(objectCacheOffset + sizeof(kmem_cache_t));
 
 	if (!buffer_cache) {
 		printf_s("Not enough memmory to initialize cache\n");
@@ -21,43 +78,167 @@ void kmem_init(void* space, int block_num)
 
 	initialize_buffer_head();
 
-	object_cache = (kmem_cache_t*)((size_t)buffer_cache+13*sizeof(buffer_cache_t));
+	object_cache = (kmem_cache_t*)((size_t)buffer_cache + objectCacheOffset);
 
-	initialize_cache(object_cache,"Cache",sizeof(kmem_cache_t), NULL, NULL);
+	initialize_cache(object_cache,"Cache",sizeof(kmem_cache_t), CACHE_L1_LINE_SIZE, SLAB_NO_MERGE, NULL, NULL);
+	register_cache(object_cache);
 }				
 
+void kmem_bind_arena(int id)
+{
+	boundArena = (id >= 0 && id < numOfArenas) ? id : -1;
+}
+
+void* arena_alloc(size_t size) {
+	int id = (boundArena >= 0) ? boundArena : thread_slot() % numOfArenas;
+	for (int i = 0; i < numOfArenas; i++) {
+		void* ret = buddy_alloc_exact(arenas[(id + i) % numOfArenas], size);
+		if (ret) return ret;
+	}
+	if (kmem_reclaim()) {
+		for (int i = 0; i < numOfArenas; i++) {
+			void* ret = buddy_alloc_exact(arenas[(id + i) % numOfArenas], size);
+			if (ret) return ret;
+		}
+	}
+	return NULL;
+}
+
+void* arena_alloc_near(size_t size, void* hint) {
+	buddy_head* arena = hint ? find_arena(hint) : NULL;
+	if (arena) {
+		void* ret = buddy_alloc_near(arena, size, hint);
+		if (ret) {
+			buddy_trim(arena, ret, size);
+			return ret;
+		}
+	}
+	return arena_alloc(size);
+}
+
+buddy_head* find_arena(const void* memptr) {
+	for (int i = 0; i < numOfArenas; i++) {
+		if (memptr >= arenas[i]->memStart && memptr < (void*)((size_t)arenas[i]->memStart + arenas[i]->memSize)) {
+			return arenas[i];
+		}
+	}
+	return NULL;
+}
+
+void arena_free(void* memptr, size_t size) {
+	buddy_head* arena = find_arena(memptr);
+	if (arena) {
+		buddy_set_owner(arena, memptr, size, NULL);
+		buddy_free_exact(arena, memptr, size);
+	}
+}
+
+void arena_set_owner(void* memptr, size_t size, void* owner) {
+	buddy_head* arena = find_arena(memptr);
+	if (arena) {
+		buddy_set_owner(arena, memptr, size, owner);
+	}
+}
+
+boolean arena_extend(void* memptr, size_t oldSize, size_t newSize) {
+	buddy_head* arena = find_arena(memptr);
+	return arena ? buddy_extend(arena, memptr, oldSize, newSize) : 0;
+}
+
+void* arena_owner(const void* memptr) {
+	buddy_head* arena = find_arena(memptr);
+	return arena ? buddy_owner(arena, memptr) : NULL;
+}
+
 
-void initialize_cache(kmem_cache_t* cache, const char* name, size_t size, void(*ctor)(void*), void(*dtor)(void*)) {
+void initialize_cache(kmem_cache_t* cache, const char* name, size_t size, size_t align, int flags, void(*ctor)(void*), void(*dtor)(void*)) {
 	cache->ctor = ctor;
 	cache->dtor = dtor;
 	cache->l1 = 0;
-	cache->name = name;
+	cache->colorStride = CACHE_L1_LINE_SIZE;
+	cache->flags = flags;
+	cache->retainSlabs = DEFAULT_RETAIN_SLABS;
+	cache->refCount = 1;
+	cache->nextCache = cache->prevCache = NULL;
+	slab_geometry(&cache->layout, size, cache_alignment(size, align, flags));
+	cache->lastSlab = NULL;
+	cache->remoteSlabs = NULL;
+	sprintf_s(cache->name, sizeof(cache->name), "%s", name ? name : "");
 	cache->size = size;
 	cache->sizeChange = 1;
-	cache->slabs[EMPTY] = NULL;
-	cache->slabs[AVAILABLE] = NULL;
-	cache->slabs[FULL] = NULL;
+	for (int i = 0; i < NUM_SLAB_LISTS; i++) {
+		cache->slabs[i] = NULL;
+		cache->numSlabs[i] = 0;
+	}
+	cache->numObjects = 0;
 	cache->error = NULL;
+	cache->magSize = default_magazine_size(size);
+	cache->fullMags = NULL;
+	cache->emptyMags = NULL;
+	cache->numMags = 0;
+	for (int i = 0; i < MAGAZINE_SLOTS; i++) {
+		cache->cpus[i].loaded = NULL;
+		cache->cpus[i].previous = NULL;
+		memset((void*)&cache->cpus[i].stats, 0, sizeof(kmem_counters_t));
+		InitializeCriticalSection(&cache->cpus[i].lock);
+	}
+	InitializeCriticalSection(&cache->depotLock);
 	InitializeCriticalSection(&cache->lock);
 }
 
+int default_magazine_size(size_t size) {
+	if (size <= 256) return 32;
+	if (size <= 1024) return 16;
+	if (size <= BLOCK_SIZE) return 8;
+	return 0;
+}
+
 void initialize_buffer_head() {
-	for (uint8_t i=0; i < (MAX_BUFFER_SIZE - MIN_BUFFER_SIZE + 1); i++) {
-		buffer_cache[i].slabs[EMPTY] = NULL;
-		buffer_cache[i].slabs[AVAILABLE] = NULL;
-		buffer_cache[i].slabs[FULL] = NULL;
-		buffer_cache[i].size = 1 << (i+5);
+	for (uint8_t i=0; i < NUM_BUFFER_CACHES; i++) {
+		for (int j = 0; j < NUM_SLAB_LISTS; j++) {
+			buffer_cache[i].slabs[j] = NULL;
+			buffer_cache[i].numSlabs[j] = 0;
+		}
+		buffer_cache[i].size = (i % 2) ? (size_t)3 << (MIN_BUFFER_SIZE + i / 2 - 1) : (size_t)1 << (MIN_BUFFER_SIZE + i / 2);
+		sprintf_s(bufferNames[i], sizeof(bufferNames[i]), "size-%zu", buffer_cache[i].size);
 		buffer_cache[i].l1 = 0;
+		slab_geometry(&buffer_cache[i].layout, buffer_cache[i].size, cache_alignment(buffer_cache[i].size, 0, 0));
+		buffer_cache[i].lastSlab = NULL;
+		buffer_cache[i].remoteSlabs = NULL;
+		buffer_cache[i].retainSlabs = DEFAULT_RETAIN_SLABS;
+		memset((void*)&buffer_cache[i].stats, 0, sizeof(kmem_counters_t));
 		buffer_cache[i].sizeChange = 0;
 		buffer_cache[i].error = NULL;
 		InitializeCriticalSection(&buffer_cache[i].lock);
 	}
+	for (int j = 0, id = 0; j < SMALL_CLASS_LIMIT / 8; j++) {
+		while (buffer_cache[id].size < (size_t)(j + 1) * 8) id++;
+		sizeIndex[j] = (uint8_t)id;
+	}
 }
 
 
 
 kmem_cache_t* kmem_cache_create(const char* name, size_t size, void(*ctor)(void*), void(*dtor)(void*))
 {
+	return kmem_cache_create_aligned(name, size, 0, 0, ctor, dtor);
+}
+
+kmem_cache_t* kmem_cache_create_aligned(const char* name, size_t size, size_t align, int flags, void(*ctor)(void*), void(*dtor)(void*))
+{
+	if ((align & (align - 1)) || align > BLOCK_SIZE) {
+		printf_s("Bad cache alignment\n");
+		return NULL;
+	}
+
+	if (!ctor && !dtor && !(flags & SLAB_NO_MERGE)) {
+		EnterCriticalSection(&cacheListLock);
+		kmem_cache_t* alias = find_mergeable(size, cache_alignment(size, align, flags));
+		if (alias) alias->refCount++;
+		LeaveCriticalSection(&cacheListLock);
+		if (alias) return alias;
+	}
+
 	kmem_cache_t* cachep = kmem_cache_alloc(object_cache);
 
 	if (!cachep) {
@@ -65,25 +246,64 @@ kmem_cache_t* kmem_cache_create(const char* name, size_t size, void(*ctor)(void*
 		return NULL;
 	}
 
-	initialize_cache(cachep, name, size, ctor, dtor);
+	initialize_cache(cachep, name, size, align, flags, ctor, dtor);
+	register_cache(cachep);
 	return cachep;
 }
 
+size_t cache_alignment(size_t size, size_t align, int flags)
+{
+	size_t ralign = 1;
+	while (ralign * 2 <= size && ralign < sizeof(void*)) ralign *= 2;
+
+	if (flags & (SLAB_HWCACHE_ALIGN | SLAB_NO_FALSE_SHARING)) {
+		size_t line = CACHE_L1_LINE_SIZE;
+		if (!(flags & SLAB_NO_FALSE_SHARING)) {
+			while (size <= line / 2) line /= 2;
+		}
+		if (line > ralign) ralign = line;
+	}
+	if (align > ralign) ralign = align;
+	return ralign;
+}
+
+kmem_cache_t* find_mergeable(size_t size, size_t align)
+{
+	for (kmem_cache_t* cachep = cacheList; cachep; cachep = cachep->nextCache) {
+		if (cachep->ctor || cachep->dtor || (cachep->flags & SLAB_NO_MERGE)) continue;
+		if (cachep->layout.objectSize == align_up(size, align) && cachep->layout.align == align) {
+			return cachep;
+		}
+	}
+	return NULL;
+}
+
+int claim_cache(kmem_cache_t* cachep)
+{
+	int ret = 1;
+	EnterCriticalSection(&cacheListLock);
+	if (cachep->refCount > 1) {
+		cachep->error = "Cache is shared, tuning refused";
+		ret = 0;
+	}
+	else cachep->flags |= SLAB_NO_MERGE;
+	LeaveCriticalSection(&cacheListLock);
+	return ret;
+}
+
 int kmem_cache_shrink(kmem_cache_t* cachep)
 {
 	if (!cachep) {
 		return 0;
 	}
-	EnterCriticalSection(&object_cache->lock);
+	magazine_flush(cachep, 0);
+	EnterCriticalSection(&cachep->lock);
 	int cnt = 0;
+	slab_head* released = NULL;
+	cachep->numObjects -= collect_remote(cachep->slabs, cachep->numSlabs, &cachep->remoteSlabs);
 	if (cachep->sizeChange == 0) {
-		while (cachep->slabs[EMPTY]) {
-			void* memptr = cachep->slabs[EMPTY];
-			slab_head* next = cachep->slabs[EMPTY]->next;
-			buddy_free(memptr, cachep->slabs[EMPTY]->slabSize);
-			cachep->slabs[EMPTY] = next;
-			cnt++;
-		}
+		cnt = release_empty_slabs(cachep->slabs, cachep->numSlabs, 0, &released);
+		InterlockedExchangeAdd64(&cache_stats(cachep)->slabsDestroyed, cnt);
 	//	cachep->error = "Shrink done";
 	//	kmem_cache_error(cachep);
 	}
@@ -92,23 +312,106 @@ int kmem_cache_shrink(kmem_cache_t* cachep)
 	//	kmem_cache_error(cachep);
 	}
 	cachep->sizeChange = 0;
-	LeaveCriticalSection(&object_cache->lock);
+	LeaveCriticalSection(&cachep->lock);
+	release_slabs(released, cachep->dtor);
 	return cnt;
 }
 
 void* alloc_one_object(slab_head* slab)
 {
-	if (!slab) return NULL;
-	void* ret = NULL;
-	for (int i = 0; i < slab->numOfSlots; i++) {
-		if (slab->freeSlots[i] == 1) {
-			ret = (void*)((size_t)slab->memmoryStart + i * slab->objectSize);
-			slab->freeSlots[i] = 0;
-			slab->numFreeSlots--;
-			return ret;
+	if (!slab || slab->firstFree == SLAB_END) return NULL;
+	size_t i = slab->firstFree;
+	slab->firstFree = slab->nextFree[i];
+	slab->numFreeSlots--;
+	return (void*)((size_t)slab->memmoryStart + i * slab->objectSize);
+}
+
+void free_one_object(slab_head* slab, const void* objp)
+{
+	size_t i = ((size_t)objp - (size_t)slab->memmoryStart) / slab->objectSize;
+	slab->nextFree[i] = slab->firstFree;
+	slab->firstFree = (uint16_t)i;
+	slab->numFreeSlots++;
+}
+
+void remote_free(slab_head* volatile* remoteSlabs, slab_head* slab, const void* objp)
+{
+	LONG i = (LONG)(((size_t)objp - (size_t)slab->memmoryStart) / slab->objectSize);
+	LONG old;
+	InterlockedIncrement(&slab->remoteBusy);
+	do {
+		old = slab->remoteFree;
+		slab->nextFree[i] = (uint16_t)old;
+	} while (InterlockedCompareExchange(&slab->remoteFree, i, old) != old);
+
+	if (!InterlockedCompareExchange(&slab->remoteQueued, 1, 0)) {
+		slab_head* top;
+		do {
+			top = *remoteSlabs;
+			slab->remoteNext = top;
+		} while (InterlockedCompareExchangePointer((PVOID volatile*)remoteSlabs, slab, top) != top);
+	}
+	InterlockedDecrement(&slab->remoteBusy);
+}
+
+size_t collect_remote(slab_head** slabs, size_t* numSlabs, slab_head* volatile* remoteSlabs)
+{
+	size_t cnt = 0;
+	slab_head* slab = InterlockedExchangePointer((PVOID volatile*)remoteSlabs, NULL);
+	while (slab) {
+		slab_head* next = slab->remoteNext;
+		InterlockedExchange(&slab->remoteQueued, 0);
+
+		LONG i = InterlockedExchange(&slab->remoteFree, SLAB_END);
+		while (i != SLAB_END) {
+			LONG k = slab->nextFree[i];
+			slab->nextFree[i] = slab->firstFree;
+			slab->firstFree = (uint16_t)i;
+			slab->numFreeSlots++;
+			cnt++;
+			i = k;
 		}
+
+		update_slab(slabs, numSlabs, slab);
+		slab = next;
 	}
-	return ret;
+	return cnt;
+}
+
+int release_empty_slabs(slab_head** slabs, size_t* numSlabs, size_t keep, slab_head** released)
+{
+	int cnt = 0;
+	slab_head* slab = slabs[EMPTY];
+	while (slab && numSlabs[EMPTY] > keep) {
+		slab_head* next = slab->next;
+		if (!slab->remoteBusy && !slab->remoteQueued) {
+			unlink_slab(slabs, numSlabs, slab);
+			slab->next = *released;
+			*released = slab;
+			cnt++;
+		}
+		slab = next;
+	}
+	return cnt;
+}
+
+void release_slabs(slab_head* slab, void (*dtor)(void*))
+{
+	while (slab) {
+		slab_head* next = slab->next;
+		release_slab(slab, dtor);
+		slab = next;
+	}
+}
+
+void reset_free_list(slab_head* slab)
+{
+	for (size_t i = 0; i < slab->numOfSlots; i++) {
+		slab->nextFree[i] = (uint16_t)(i + 1);
+	}
+	slab->nextFree[slab->numOfSlots - 1] = SLAB_END;
+	slab->firstFree = 0;
+	slab->numFreeSlots = slab->numOfSlots;
 }
 
 
@@ -116,9 +419,25 @@ void* alloc_one_object(slab_head* slab)
 void* kmem_cache_alloc(kmem_cache_t* cachep)
 {
 	if (!cachep) return NULL;
-	EnterCriticalSection(&cachep->lock);
+	kmem_counters_t* stats = cache_stats(cachep);
+	void* ret = magazine_alloc(cachep);
+	if (ret) {
+		InterlockedIncrement64(&stats->fastHits);
+	}
+	else {
+		ret = slab_alloc(cachep);
+	}
+	if (ret) InterlockedIncrement64(&stats->allocs);
+	return ret;
+}
+
+void* slab_alloc(kmem_cache_t* cachep)
+{
+	lock_counted(&cachep->lock, cache_stats(cachep));
 	void* ret = NULL;
 	if (cachep ) {
+		if (!cachep->slabs[AVAILABLE] && !cachep->slabs[EMPTY])
+			cachep->numObjects -= collect_remote(cachep->slabs, cachep->numSlabs, &cachep->remoteSlabs);
 		if (cachep->slabs[AVAILABLE]) {									
 			ret = alloc_one_object(cachep->slabs[1]); 
 
@@ -129,8 +448,7 @@ void* kmem_cache_alloc(kmem_cache_t* cachep)
 				return NULL;
 			}
 
-			if (!cachep->slabs[AVAILABLE]->numFreeSlots)
-				move_slab(cachep->slabs, cachep->slabs[AVAILABLE], FULL);
+			update_slab(cachep->slabs, cachep->numSlabs, cachep->slabs[AVAILABLE]);
 		}
 		else if (cachep->slabs[EMPTY]) {						
 			ret = alloc_one_object(cachep->slabs[EMPTY]);
@@ -142,20 +460,24 @@ void* kmem_cache_alloc(kmem_cache_t* cachep)
 				return NULL;
 			}
 
-			if (!cachep->slabs[EMPTY]->numFreeSlots)
-				move_slab(cachep->slabs, cachep->slabs[EMPTY], FULL);
-			else
-				move_slab(cachep->slabs, cachep->slabs[EMPTY], AVAILABLE);
+			update_slab(cachep->slabs, cachep->numSlabs, cachep->slabs[EMPTY]);
 		}
 		else {												
-			create_slab(cachep->slabs,cachep->size, &cachep->l1);
+			create_slab(cachep, cachep->slabs, cachep->numSlabs, &cachep->layout, &cachep->l1, cachep->colorStride, &cachep->lastSlab, cachep->ctor);
 
 			if (!cachep->slabs[AVAILABLE]) {
-				cachep->error = "Fail creating slab";
 				LeaveCriticalSection(&cachep->lock);
+				if (kmem_reclaim()) {
+					noReclaim++;
+					ret = slab_alloc(cachep);
+					noReclaim--;
+					return ret;
+				}
+				cachep->error = "Fail creating slab";
 				kmem_cache_error(cachep);
 				return NULL;
 			}
+			InterlockedIncrement64(&cache_stats(cachep)->slabsCreated);
 
 			ret = alloc_one_object(cachep->slabs[AVAILABLE]);
 
@@ -167,160 +489,514 @@ void* kmem_cache_alloc(kmem_cache_t* cachep)
 			}
 
 			cachep->sizeChange = 1;
-			if (!cachep->slabs[AVAILABLE]->numFreeSlots)
-				move_slab(cachep->slabs, cachep->slabs[AVAILABLE], FULL);
+			update_slab(cachep->slabs, cachep->numSlabs, cachep->slabs[AVAILABLE]);
 
 		}
 
-		if (cachep->ctor) {
-			cachep->ctor(ret);
-		}
-
 	}
+	if (ret) cachep->numObjects++;
 	LeaveCriticalSection(&cachep->lock);
 	return ret;
 }
 
+int kmem_cache_alloc_bulk(kmem_cache_t* cachep, size_t nr, void** p)
+{
+	if (!cachep || !p) return 0;
+	size_t cnt = 0;
+	boolean retried = 0;
+	kmem_counters_t* stats = cache_stats(cachep);
+	lock_counted(&cachep->lock, stats);
+	while (cnt < nr) {
+		slab_head* slab = cachep->slabs[AVAILABLE] ? cachep->slabs[AVAILABLE] : cachep->slabs[EMPTY];
+		if (!slab) {
+			cachep->numObjects -= collect_remote(cachep->slabs, cachep->numSlabs, &cachep->remoteSlabs);
+			slab = cachep->slabs[AVAILABLE] ? cachep->slabs[AVAILABLE] : cachep->slabs[EMPTY];
+		}
+		if (!slab) {
+			create_slab(cachep, cachep->slabs, cachep->numSlabs, &cachep->layout, &cachep->l1, cachep->colorStride, &cachep->lastSlab, cachep->ctor);
+			slab = cachep->slabs[AVAILABLE];
+			if (!slab) {
+				if (retried) break;
+				LeaveCriticalSection(&cachep->lock);
+				retried = kmem_reclaim() > 0;
+				lock_counted(&cachep->lock, stats);
+				if (!retried) break;
+				continue;
+			}
+			InterlockedIncrement64(&stats->slabsCreated);
+			cachep->sizeChange = 1;
+		}
+		cnt += slab_alloc_run(cachep->slabs, cachep->numSlabs, slab, nr - cnt, p + cnt);
+	}
+	if (cnt < nr) {
+		qsort(p, cnt, sizeof(void*), compare_objects);
+		free_runs(cachep, cnt, p);
+		LeaveCriticalSection(&cachep->lock);
+		cachep->error = "Bulk allocation failed";
+		kmem_cache_error(cachep);
+		return 0;
+	}
+	cachep->numObjects += cnt;
+	LeaveCriticalSection(&cachep->lock);
+
+	InterlockedExchangeAdd64(&stats->allocs, nr);
+	return (int)nr;
+}
+
+void kmem_cache_free_bulk(kmem_cache_t* cachep, size_t nr, void** p)
+{
+	if (!cachep || !p) return;
+	qsort(p, nr, sizeof(void*), compare_objects);
+	kmem_counters_t* stats = cache_stats(cachep);
+	lock_counted(&cachep->lock, stats);
+	size_t cnt = free_runs(cachep, nr, p);
+	cachep->numObjects -= cnt;
+	InterlockedExchangeAdd64(&stats->frees, cnt);
+	LeaveCriticalSection(&cachep->lock);
+}
+
+size_t free_runs(kmem_cache_t* cachep, size_t nr, void** p)
+{
+	size_t cnt = 0, i = 0;
+	while (i < nr) {
+		slab_head* slab = find_slab(p[i]);
+		if (!slab || slab->cache != cachep) {
+			cachep->error = "Object is not in cache";
+			kmem_cache_error(cachep);
+			i++;
+			continue;
+		}
+		size_t run = slab_free_run(cachep->slabs, cachep->numSlabs, slab, nr - i, p + i);
+		cnt += run;
+		i += run;
+	}
+	return cnt;
+}
+
+size_t slab_alloc_run(slab_head** slabs, size_t* numSlabs, slab_head* slab, size_t nr, void** p)
+{
+	size_t cnt = 0;
+	while (cnt < nr && slab->numFreeSlots) {
+		p[cnt++] = alloc_one_object(slab);
+	}
+	update_slab(slabs, numSlabs, slab);
+	return cnt;
+}
+
+size_t slab_free_run(slab_head** slabs, size_t* numSlabs, slab_head* slab, size_t nr, void** p)
+{
+	void* end = (void*)((size_t)slab->memmoryStart + slab->objectSize * slab->numOfSlots);
+	size_t cnt = 0;
+	while (cnt < nr && p[cnt] >= slab->memmoryStart && p[cnt] < end) {
+		free_one_object(slab, p[cnt++]);
+	}
+	update_slab(slabs, numSlabs, slab);
+	return cnt;
+}
+
+int compare_objects(const void* a, const void* b)
+{
+	size_t x = *(const size_t*)a, y = *(const size_t*)b;
+	return (x > y) - (x < y);
+}
+
 void kmem_cache_free(kmem_cache_t* cachep, void* objp)
 {
-	EnterCriticalSection(&cachep->lock);
-	slab_head* slab = find_slab(cachep->slabs, objp);
-	if (!slab) {
+	slab_head* slab = find_slab(objp);
+	if (!slab || slab->cache != cachep) {
 		cachep->error = "Object is not in cache";
 		kmem_cache_error(cachep);
-		LeaveCriticalSection(&cachep->lock);
-		return NULL;
+		return;
 	}
-	size_t num = ((size_t)objp - (size_t)slab->memmoryStart) / slab->objectSize;
-	slab->freeSlots[num] = 1;
-	slab->numFreeSlots++;
-	if (slab->numFreeSlots == slab->numOfSlots) {
-		move_slab(cachep->slabs, slab, EMPTY);
+	InterlockedIncrement64(&cache_stats(cachep)->frees);
+	if (!magazine_free(cachep, objp)) {
+		slab_free(cachep, slab, objp);
 	}
-	else if (slab->type == FULL) {
-		move_slab(cachep->slabs, slab, AVAILABLE);
+}
+
+void slab_free(kmem_cache_t* cachep, slab_head* slab, void* objp)
+{
+	if (slab->owner != thread_slot()) {
+		remote_free(&cachep->remoteSlabs, slab, objp);
+		return;
 	}
+	lock_counted(&cachep->lock, cache_stats(cachep));
+	free_one_object(slab, objp);
+	cachep->numObjects--;
+	update_slab(cachep->slabs, cachep->numSlabs, slab);
 	LeaveCriticalSection(&cachep->lock);
 }
 
 
 
-void move_slab(slab_head** slabs, slab_head* slab, SlabType t2) {
-	slab_head* curr = slabs[slab->type], * prev = NULL;
-	while (curr != slab) {
-		prev = curr;
-		curr = curr->next;
+cpu_cache_t* local_cpu_cache(kmem_cache_t* cachep) {
+	return &cachep->cpus[thread_slot() % MAGAZINE_SLOTS];
+}
+
+void* magazine_alloc(kmem_cache_t* cachep)
+{
+	if (!cachep->magSize) return NULL;
+	cpu_cache_t* cpu = local_cpu_cache(cachep);
+	void* ret = NULL;
+	EnterCriticalSection(&cpu->lock);
+	if (!cpu->loaded || !cpu->loaded->rounds) {
+		if (cpu->previous && cpu->previous->rounds) {
+			magazine_t* help = cpu->loaded;
+			cpu->loaded = cpu->previous;
+			cpu->previous = help;
+		}
+		else {
+			EnterCriticalSection(&cachep->depotLock);
+			magazine_t* full = cachep->fullMags;
+			if (full) {
+				cachep->fullMags = full->next;
+				if (cpu->previous) {
+					cpu->previous->next = cachep->emptyMags;
+					cachep->emptyMags = cpu->previous;
+				}
+				cpu->previous = cpu->loaded;
+				cpu->loaded = full;
+			}
+			LeaveCriticalSection(&cachep->depotLock);
+		}
 	}
-	if (!prev)
-		slabs[slab->type] = curr->next;
-	else
-		prev->next = curr->next;
+	if (cpu->loaded && cpu->loaded->rounds) {
+		ret = cpu->loaded->objs[--cpu->loaded->rounds];
+	}
+	LeaveCriticalSection(&cpu->lock);
+	return ret;
+}
 
-	slab->type = t2;
-	slab->next = NULL;
-	slab_head* curr2 = slabs[t2], *prev2 = NULL;
-	while (curr2) {
-		prev2 = curr2;
-		curr2 = curr2->next;
+boolean magazine_free(kmem_cache_t* cachep, void* objp)
+{
+	if (!cachep->magSize) return 0;
+	cpu_cache_t* cpu = local_cpu_cache(cachep);
+	boolean ret = 0;
+	EnterCriticalSection(&cpu->lock);
+	if (!cpu->loaded || cpu->loaded->rounds == cpu->loaded->size) {
+		if (cpu->previous && cpu->previous->rounds < cpu->previous->size) {
+			magazine_t* help = cpu->loaded;
+			cpu->loaded = cpu->previous;
+			cpu->previous = help;
+		}
+		else {
+			EnterCriticalSection(&cachep->depotLock);
+			magazine_t* empty = cachep->emptyMags;
+			if (empty) {
+				cachep->emptyMags = empty->next;
+			}
+			LeaveCriticalSection(&cachep->depotLock);
+			int size = cachep->magSize;
+			if (!empty && size) {
+				if (InterlockedIncrement(&cachep->numMags) <= MAX_MAGAZINES) {
+					noReclaim++;
+					empty = kmalloc(sizeof(magazine_t) + size * sizeof(void*));
+					noReclaim--;
+				}
+				if (empty) {
+					empty->rounds = 0;
+					empty->size = size;
+				}
+				else {
+					InterlockedDecrement(&cachep->numMags);
+				}
+			}
+			if (empty) {
+				if (cpu->previous) {
+					EnterCriticalSection(&cachep->depotLock);
+					cpu->previous->next = cachep->fullMags;
+					cachep->fullMags = cpu->previous;
+					LeaveCriticalSection(&cachep->depotLock);
+				}
+				cpu->previous = cpu->loaded;
+				cpu->loaded = empty;
+			}
+		}
 	}
-	if (prev2) {
-		prev2->next = slab;
+	if (cpu->loaded && cpu->loaded->rounds < cpu->loaded->size) {
+		cpu->loaded->objs[cpu->loaded->rounds++] = objp;
+		ret = 1;
 	}
-	else {
-		slabs[t2] = slab;
+	LeaveCriticalSection(&cpu->lock);
+	return ret;
+}
+
+void magazine_empty(kmem_cache_t* cachep, magazine_t* mag)
+{
+	while (mag) {
+		magazine_t* next = mag->next;
+		while (mag->rounds) {
+			void* objp = mag->objs[--mag->rounds];
+			slab_free(cachep, find_slab(objp), objp);
+		}
+		kfree(mag);
+		InterlockedDecrement(&cachep->numMags);
+		mag = next;
+	}
+}
+
+void magazine_flush(kmem_cache_t* cachep, boolean all)
+{
+	EnterCriticalSection(&cachep->depotLock);
+	magazine_t* full = cachep->fullMags, * empty = cachep->emptyMags;
+	cachep->fullMags = cachep->emptyMags = NULL;
+	LeaveCriticalSection(&cachep->depotLock);
+
+	magazine_empty(cachep, full);
+	magazine_empty(cachep, empty);
+
+	if (!all) return;
+
+	for (int i = 0; i < MAGAZINE_SLOTS; i++) {
+		cpu_cache_t* cpu = &cachep->cpus[i];
+		EnterCriticalSection(&cpu->lock);
+		magazine_t* loaded = cpu->loaded, * previous = cpu->previous;
+		cpu->loaded = cpu->previous = NULL;
+		LeaveCriticalSection(&cpu->lock);
+		if (loaded) {
+			loaded->next = NULL;
+			magazine_empty(cachep, loaded);
+		}
+		if (previous) {
+			previous->next = NULL;
+			magazine_empty(cachep, previous);
+		}
+	}
+}
+
+void kmem_cache_set_magazine(kmem_cache_t* cachep, int size)
+{
+	if (!cachep || size < 0 || !claim_cache(cachep)) return;
+	magazine_flush(cachep, 1);
+	cachep->magSize = size;
+}
+
+
+
+void kmem_cache_set_color(kmem_cache_t* cachep, size_t stride)
+{
+	if (!cachep || !claim_cache(cachep)) return;
+	EnterCriticalSection(&cachep->lock);
+	cachep->colorStride = stride;
+	cachep->l1 = 0;
+	LeaveCriticalSection(&cachep->lock);
+}
+
+void move_slab(slab_head** slabs, size_t* numSlabs, slab_head* slab, SlabType t2) {
+	unlink_slab(slabs, numSlabs, slab);
+	link_slab(slabs, numSlabs, slab, t2);
+}
+
+void link_slab(slab_head** slabs, size_t* numSlabs, slab_head* slab, SlabType t) {
+	int l = slab_list(slab, t);
+	slab->type = t;
+	slab->list = l;
+	slab->prev = NULL;
+	slab->next = slabs[l];
+	if (slabs[l]) slabs[l]->prev = slab;
+	slabs[l] = slab;
+	numSlabs[l]++;
+	if (t == AVAILABLE) {
+		numSlabs[AVAILABLE]++;
+		slabs[AVAILABLE] = fullest_partial(slabs);
 	}
 }
 
+void unlink_slab(slab_head** slabs, size_t* numSlabs, slab_head* slab) {
+	if (slab->prev) slab->prev->next = slab->next;
+	else slabs[slab->list] = slab->next;
+	if (slab->next) slab->next->prev = slab->prev;
+	slab->next = slab->prev = NULL;
+	numSlabs[slab->list]--;
+	if (slab->type == AVAILABLE) {
+		numSlabs[AVAILABLE]--;
+		slabs[AVAILABLE] = fullest_partial(slabs);
+	}
+}
+
+void update_slab(slab_head** slabs, size_t* numSlabs, slab_head* slab) {
+	SlabType t = !slab->numFreeSlots ? FULL : (slab->numFreeSlots == slab->numOfSlots ? EMPTY : AVAILABLE);
+	if (t != slab->type || slab_list(slab, t) != slab->list) {
+		move_slab(slabs, numSlabs, slab, t);
+	}
+}
+
+int slab_list(const slab_head* slab, SlabType t) {
+	if (t != AVAILABLE) return t;
+	size_t bucket = slab->numFreeSlots * PARTIAL_BUCKETS / slab->numOfSlots;
+	return PARTIAL_LIST + (int)(bucket < PARTIAL_BUCKETS ? bucket : PARTIAL_BUCKETS - 1);
+}
+
+slab_head* fullest_partial(slab_head** slabs) {
+	for (int i = PARTIAL_LIST; i < NUM_SLAB_LISTS; i++) {
+		if (slabs[i]) return slabs[i];
+	}
+	return NULL;
+}
+
 int buffer_cache_shrink(buffer_cache_t* cachep)
 {
 	if (!cachep) {
 		return 0;
 	}
-	EnterCriticalSection(&object_cache->lock);
+	EnterCriticalSection(&cachep->lock);
 	int cnt = 0;
+	slab_head* released = NULL;
+	collect_remote(cachep->slabs, cachep->numSlabs, &cachep->remoteSlabs);
 	if (cachep->sizeChange == 0) {
-		while (cachep->slabs[EMPTY]) {
-			void* memptr = cachep->slabs[EMPTY];
-			slab_head* next = cachep->slabs[EMPTY]->next;
-			buddy_free(memptr, cachep->slabs[EMPTY]->slabSize);
-			cachep->slabs[EMPTY] = next;
-			cnt++;
-		}
+		cnt = release_empty_slabs(cachep->slabs, cachep->numSlabs, 0, &released);
+		InterlockedExchangeAdd64(&cachep->stats.slabsDestroyed, cnt);
 	//	printf_s("Shrink done\n");
 	}
 	else {
 	//	printf_s("Shrink not executed\n");
 	}
 	cachep->sizeChange = 0;
-	LeaveCriticalSection(&object_cache->lock);
+	LeaveCriticalSection(&cachep->lock);
+	release_slabs(released, NULL);
 	return cnt;
 }
 
-void create_slab(slab_head** slabs, size_t objectSize, size_t* l1) {
+size_t slab_meta_size(size_t num, size_t align) {
+	return align_up(sizeof(slab_head) + num * sizeof(uint16_t), align);
+}
 
-	size_t size = slab_size(objectSize + sizeof(slab_head)) * BLOCK_SIZE;
-	slab_head* slab = buddy_alloc(size);									
+size_t slab_objects(size_t size, size_t objectSize, size_t align, boolean offSlab) {
+	size_t num;
+	if (offSlab) {
+		num = size / objectSize;
+	}
+	else {
+		if (size <= sizeof(slab_head)) return 0;
+		num = (size - sizeof(slab_head)) / (objectSize + sizeof(uint16_t));
+		if (num > SLAB_END) num = SLAB_END;
+		while (num && slab_meta_size(num, align) + num * objectSize > size) num--;
+	}
+	return num > SLAB_END ? SLAB_END : num;
+}
 
-	if (!slab) return;
+void slab_geometry(slab_layout_t* layout, size_t size, size_t align) {
+	size_t objectSize = align_up(size, align);
+	size_t bestSize = 0, bestWaste = 0;
+	boolean bestOff = 0;
+	for (size_t pages = 1; pages <= (1 << MAX_SLAB_ORDER); pages++) {
+		size_t slabSize = pages * BLOCK_SIZE;
+		boolean off = objectSize >= OFF_SLAB_MIN && slab_objects(slabSize, objectSize, align, 1) > slab_objects(slabSize, objectSize, align, 0);
+		size_t num = slab_objects(slabSize, objectSize, align, off);
+		if (!num) continue;
+		size_t waste = slabSize - num * objectSize - (off ? 0 : slab_meta_size(num, align));
+		if (!bestSize || waste * bestSize < bestWaste * slabSize) {
+			bestSize = slabSize;
+			bestWaste = waste;
+			bestOff = off;
+		}
+		if (bestWaste * 8 <= bestSize) break;
+	}
+	if (!bestSize) {
+		bestOff = objectSize >= OFF_SLAB_MIN;
+		bestSize = align_up(objectSize + (bestOff ? 0 : slab_meta_size(1, align)), BLOCK_SIZE);
+	}
+	layout->objectSize = objectSize;
+	layout->align = align;
+	layout->slabSize = bestSize;
+	layout->offSlab = bestOff;
+	layout->numOfSlots = slab_objects(bestSize, objectSize, align, bestOff);
+}
 
-	slab->slabSize = size;
-	slab->objectSize = objectSize;
-	slab->next = NULL;
-	slab->type = AVAILABLE;
+void create_slab(void* cache, slab_head** slabs, size_t* numSlabs, const slab_layout_t* layout, size_t* l1, size_t colorStride, void** lastSlab, void (*ctor)(void*)) {
 
-	size_t num = (size-sizeof(slab_head)) / objectSize;
+	size_t size = layout->slabSize;
+	size_t num = layout->numOfSlots;
+	noReclaim++;
+	void* base = arena_alloc_near(size, *lastSlab);									
 
-	size_t si = sizeof(uint8_t) * num;
-	slab->numOfSlots = (size - sizeof(slab_head) - si) / objectSize;
+	if (!base) {
+		noReclaim--;
+		return;
+	}
+
+	size_t si = sizeof(uint16_t) * num;
+	size_t meta = slab_meta_size(num, layout->align);
+	slab_head* slab = base;
 
-	if (slab->numOfSlots == 0) {
-		num = (size - sizeof(slab_head)) / (objectSize*2);
-		si = sizeof(uint8_t) * num;
-		slab->numOfSlots = (size - sizeof(slab_head) - si) / objectSize;
+	if (layout->offSlab) {
+		slab = kmalloc(sizeof(slab_head) + si);
+		if (!slab) {
+			arena_free(base, size);
+			noReclaim--;
+			return;
+		}
+		meta = 0;
 	}
 
-	size_t freeSpace = size - sizeof(slab_head) - si- (slab->numOfSlots * objectSize);
-	size_t offset = *l1 + CACHE_L1_LINE_SIZE;
+	*lastSlab = base;
+	arena_set_owner(base, size, slab);
+
+	slab->cache = cache;
+	slab->base = base;
+	slab->slabSize = size;
+	slab->objectSize = layout->objectSize;
+	slab->owner = thread_slot();
+	slab->remoteFree = SLAB_END;
+	slab->remoteQueued = 0;
+	slab->remoteBusy = 0;
+	slab->remoteNext = NULL;
+	slab->numOfSlots = num;
 
-	if (offset > freeSpace) offset = 0;
+	size_t freeSpace = size - meta - (slab->numOfSlots * slab->objectSize);
+	size_t stride = colorStride ? align_up(colorStride, layout->align) : 0;
+	size_t offset = *l1;
 
-	*l1 = offset;
+	if (!stride || offset > freeSpace) offset = 0;
 
-	slab->memmoryStart = (void*)((size_t)slab + sizeof(slab_head)+sizeof(uint8_t)*num);
+	*l1 = (stride && offset + stride <= freeSpace) ? offset + stride : 0;
 
+	slab->memmoryStart = (void*)((size_t)base + meta + offset);
 
-	slab->freeSlots = (void*)((size_t)slab + sizeof(slab_head));
+	slab->nextFree = (uint16_t*)((size_t)slab + sizeof(slab_head));
 
-	for (int i = 0; i < slab->numOfSlots; i++) {
-		slab->freeSlots[i] = 1;
+	reset_free_list(slab);
+
+	if (ctor) {
+		for (size_t i = 0; i < num; i++) {
+			ctor((void*)((size_t)slab->memmoryStart + i * slab->objectSize));
+		}
 	}
 
-	slab->numFreeSlots = slab->numOfSlots;
+	link_slab(slabs, numSlabs, slab, AVAILABLE);
+	noReclaim--;
+}
 
-	slab_head* curr = slabs[AVAILABLE], * prev = NULL;
-	while (curr) {
-		prev = curr;
-		curr = curr->next;
+void release_slab(slab_head* slab, void (*dtor)(void*)) {
+	void* base = slab->base;
+	if (dtor) {
+		for (size_t i = 0; i < slab->numOfSlots; i++) {
+			dtor((void*)((size_t)slab->memmoryStart + i * slab->objectSize));
+		}
 	}
-	if (prev) prev->next = slab;
-	else slabs[AVAILABLE] = slab;
+	arena_free(base, slab->slabSize);
+	if (base != slab) kfree(slab);
 }
 
 
 void* kmalloc(size_t size)
 {
-	size = block_size(size);
-	if ((size < MIN_BUFFER_SIZE) && (size > MAX_BUFFER_SIZE)) {
+	if (!size) {
 		printf_s("Bad buffer size");
 		return NULL;
 	}
+	if (size > buffer_cache[NUM_BUFFER_CACHES - 1].size) {
+		return kmalloc_large(size);
+	}
 
-
-	int id = size - MIN_BUFFER_SIZE;
-	EnterCriticalSection(&buffer_cache[id].lock);
+	int id = buffer_class(size);
+	lock_counted(&buffer_cache[id].lock, &buffer_cache[id].stats);
 
 	void* ret = NULL;
 
+	if (!buffer_cache[id].slabs[AVAILABLE] && !buffer_cache[id].slabs[EMPTY])
+		collect_remote(buffer_cache[id].slabs, buffer_cache[id].numSlabs, &buffer_cache[id].remoteSlabs);
+
 	if (buffer_cache[id].slabs[AVAILABLE]) {										
 		ret = alloc_one_object(buffer_cache[id].slabs[AVAILABLE]);
 		if (!ret) {
@@ -328,8 +1004,7 @@ void* kmalloc(size_t size)
 			LeaveCriticalSection(&buffer_cache[id].lock);
 			return NULL;
 		}
-		if (!buffer_cache[id].slabs[AVAILABLE]->numFreeSlots)
-			move_slab(buffer_cache[id].slabs, buffer_cache[id].slabs[AVAILABLE], FULL);
+		update_slab(buffer_cache[id].slabs, buffer_cache[id].numSlabs, buffer_cache[id].slabs[AVAILABLE]);
 	}
 
 	else if (buffer_cache[id].slabs[EMPTY]) {
@@ -339,20 +1014,24 @@ void* kmalloc(size_t size)
 			LeaveCriticalSection(&buffer_cache[id].lock);
 			return NULL;
 		}
-		if (!buffer_cache[id].slabs[EMPTY]->numFreeSlots)
-			move_slab(buffer_cache[id].slabs, buffer_cache[id].slabs[EMPTY], FULL);
-		else
-			move_slab(buffer_cache[id].slabs, buffer_cache[id].slabs[EMPTY], AVAILABLE);
+		update_slab(buffer_cache[id].slabs, buffer_cache[id].numSlabs, buffer_cache[id].slabs[EMPTY]);
 	}
 
 	else {														
-		create_slab(buffer_cache[id].slabs, buffer_cache[id].size, &buffer_cache[id].l1);	
+		create_slab(&buffer_cache[id], buffer_cache[id].slabs, buffer_cache[id].numSlabs, &buffer_cache[id].layout, &buffer_cache[id].l1, CACHE_L1_LINE_SIZE, &buffer_cache[id].lastSlab, NULL);	
 
 		if (!buffer_cache[id].slabs[AVAILABLE]) {
-			printf_s("Failed creating slab, not enough memmory\n");
 			LeaveCriticalSection(&buffer_cache[id].lock);
+			if (kmem_reclaim()) {
+				noReclaim++;
+				ret = kmalloc(size);
+				noReclaim--;
+				return ret;
+			}
+			printf_s("Failed creating slab, not enough memmory\n");
 			return NULL;
 		}
+		InterlockedIncrement64(&buffer_cache[id].stats.slabsCreated);
 
 		ret = alloc_one_object(buffer_cache[id].slabs[AVAILABLE]);
 		
@@ -363,16 +1042,49 @@ void* kmalloc(size_t size)
 		}
 
 		buffer_cache[id].sizeChange = 1;
-		if (!buffer_cache[id].slabs[AVAILABLE]->numFreeSlots)
-			move_slab(buffer_cache[id].slabs, buffer_cache[id].slabs[AVAILABLE], FULL);
+		update_slab(buffer_cache[id].slabs, buffer_cache[id].numSlabs, buffer_cache[id].slabs[AVAILABLE]);
 	}
 
+	InterlockedIncrement64(&buffer_cache[id].stats.allocs);
 	LeaveCriticalSection(&buffer_cache[id].lock);
 	return ret;
 }
 
+int buffer_class(size_t size)
+{
+	if (size <= SMALL_CLASS_LIMIT) return sizeIndex[(size - 1) >> 3];
+	int p = block_size((int)size);
+	if (size <= (size_t)3 << (p - 2)) return 2 * (p - MIN_BUFFER_SIZE) - 1;
+	return 2 * (p - MIN_BUFFER_SIZE);
+}
+
+void* kmalloc_large(size_t size)
+{
+	size_t pages = align_up(size, BLOCK_SIZE) / BLOCK_SIZE;
+	void* ret = arena_alloc(pages * BLOCK_SIZE);
+	if (!ret) {
+		printf_s("Buffer allocation failed\n");
+		return NULL;
+	}
+	arena_set_owner(ret, BLOCK_SIZE, (void*)((pages << 1) | LARGE_ALLOC));
+	return ret;
+}
+
+size_t large_size(const void* objp)
+{
+	size_t owner = (size_t)arena_owner(objp);
+	if (!(owner & LARGE_ALLOC) || ((size_t)objp & (BLOCK_SIZE - 1))) return 0;
+	return (owner >> 1) * BLOCK_SIZE;
+}
+
 void kfree(const void* objp)
 {
+	size_t large = large_size(objp);
+	if (large) {
+		arena_free((void*)objp, large);
+		return;
+	}
+
 	buffer_cache_t* cachep = find_buffer_cache(objp);		
 
 	if (!cachep) {
@@ -380,106 +1092,351 @@ void kfree(const void* objp)
 		return NULL;
 	}
 
-	EnterCriticalSection(&cachep->lock);
-
-
-	slab_head* slab = find_slab(cachep->slabs, objp);	
+	slab_head* slab = find_slab(objp);	
 
 	if (!slab) {
 		printf_s("Object not in cache\n");
-		LeaveCriticalSection(&cachep->lock);
 		return NULL;
 	}
 
-	size_t num = ((size_t)objp - (size_t)slab->memmoryStart) / slab->objectSize;
-	slab->freeSlots[num] = 1;
-	if (slab->numFreeSlots == slab->numOfSlots) {
-		move_slab(cachep->slabs, slab, EMPTY); 
-		buffer_cache_shrink(cachep);
-	}
-	else if (slab->type == FULL) {
-		move_slab(cachep->slabs, slab, AVAILABLE);
+	InterlockedIncrement64(&cachep->stats.frees);
+
+	if (slab->owner != thread_slot()) {
+		remote_free(&cachep->remoteSlabs, slab, objp);
+		return;
 	}
 
+	lock_counted(&cachep->lock, &cachep->stats);
+
+	free_one_object(slab, objp);
+	update_slab(cachep->slabs, cachep->numSlabs, slab);
+
 	LeaveCriticalSection(&cachep->lock);
 }
 
 
 
-buffer_cache_t* find_buffer_cache(void* objp) {
-	for (uint8_t i = 0; i < (MAX_BUFFER_SIZE - MIN_BUFFER_SIZE + 1); i++) {
-		for (uint8_t j = 0; j < 3; j++) {
-			slab_head* slab = buffer_cache[i].slabs[j];
-			while (slab) {
-				if (slab->memmoryStart <= objp && (void*)((size_t)slab->memmoryStart + slab->objectSize * slab->numOfSlots) >= objp) {
-					return &buffer_cache[i];
-				}
-				slab = slab->next;
-			}
+void kfree_bulk(size_t nr, void** p)
+{
+	if (!p) return;
+	qsort(p, nr, sizeof(void*), compare_objects);
+	buffer_cache_t* locked = NULL;
+	size_t i = 0;
+	while (i < nr) {
+		size_t large = p[i] ? large_size(p[i]) : 0;
+		if (large) {
+			arena_free(p[i++], large);
+			continue;
+		}
+		buffer_cache_t* cachep = p[i] ? find_buffer_cache(p[i]) : NULL;
+		if (!cachep) {
+			if (p[i]) printf_s("Object is not in cache\n");
+			i++;
+			continue;
+		}
+		if (cachep != locked) {
+			if (locked) LeaveCriticalSection(&locked->lock);
+			lock_counted(&cachep->lock, &cachep->stats);
+			locked = cachep;
 		}
+		size_t cnt = slab_free_run(cachep->slabs, cachep->numSlabs, find_slab(p[i]), nr - i, p + i);
+		InterlockedExchangeAdd64(&cachep->stats.frees, cnt);
+		i += cnt;
 	}
-	return NULL;
+	if (locked) LeaveCriticalSection(&locked->lock);
 }
 
-slab_head* find_slab(slab_head** slabs, void* objp) {
-	for (uint8_t j = 0; j < 3; j++) {
-		slab_head* slab = slabs[j];
-		while (slab) {
-			if ( slab->memmoryStart <= objp && (void*)((size_t)slab->memmoryStart + slab->objectSize * slab->numOfSlots) >= objp) {
-				return slab;
+size_t ksize(const void* objp)
+{
+	size_t large = large_size(objp);
+	if (large) return large;
+	buffer_cache_t* cachep = find_buffer_cache(objp);
+	return cachep ? cachep->size : 0;
+}
+
+void* krealloc(const void* objp, size_t size)
+{
+	if (!objp) return kmalloc(size);
+	if (!size) {
+		kfree(objp);
+		return NULL;
+	}
+	size_t old = ksize(objp);
+	if (!old) {
+		printf_s("Object is not in cache\n");
+		return NULL;
+	}
+
+	size_t large = large_size(objp);
+	if (large) {
+		size_t pages = align_up(size, BLOCK_SIZE) / BLOCK_SIZE;
+		if (size <= old || arena_extend((void*)objp, old, pages * BLOCK_SIZE)) {
+			if (size <= old && pages * BLOCK_SIZE < old) {
+				arena_free((void*)((size_t)objp + pages * BLOCK_SIZE), old - pages * BLOCK_SIZE);
 			}
-			slab = slab->next;
+			arena_set_owner((void*)objp, BLOCK_SIZE, (void*)((pages << 1) | LARGE_ALLOC));
+			return (void*)objp;
 		}
 	}
-	return NULL;
+	else if (size <= old) {
+		return (void*)objp;
+	}
+
+	void* ret = kmalloc(size);
+	if (!ret) return NULL;
+	memcpy(ret, objp, old < size ? old : size);
+	kfree(objp);
+	return ret;
+}
+
+buffer_cache_t* find_buffer_cache(const void* objp) {
+	slab_head* slab = find_slab(objp);
+	if (!slab) return NULL;
+	buffer_cache_t* cachep = slab->cache;
+	if (cachep < buffer_cache || cachep >= buffer_cache + NUM_BUFFER_CACHES) {
+		return NULL;
+	}
+	return cachep;
+}
+
+slab_head* find_slab(const void* objp) {
+	slab_head* slab = arena_owner(objp);
+	if (!slab || ((size_t)slab & LARGE_ALLOC) || objp < slab->memmoryStart || objp >= (void*)((size_t)slab->memmoryStart + slab->objectSize * slab->numOfSlots)) {
+		return NULL;
+	}
+	return slab;
 }
 
 
 
 void kmem_cache_destroy(kmem_cache_t* cachep)
 {
+	EnterCriticalSection(&cacheListLock);
+	if (--cachep->refCount > 0) {
+		LeaveCriticalSection(&cacheListLock);
+		return;
+	}
+	unregister_cache(cachep);
+	LeaveCriticalSection(&cacheListLock);
+	magazine_flush(cachep, 1);
 	EnterCriticalSection(&cachep->lock);
-	for (int i = 1; i < 3; i++) {
+	collect_remote(cachep->slabs, cachep->numSlabs, &cachep->remoteSlabs);
+	cachep->numObjects = 0;
+	for (int i = FULL; i < NUM_SLAB_LISTS; i++) {
 		slab_head* slab = cachep->slabs[i];
 		while (slab) {
-			for (int j = 0; j < slab->numOfSlots; j++) {
-				if (slab->freeSlots[j] == 0) {
-					slab->freeSlots[j] = 1;
-					slab->numFreeSlots++;
-				}
-			}
-			move_slab(cachep->slabs, slab, EMPTY);
-			slab = slab->next;
+			slab_head* next = slab->next;
+			reset_free_list(slab);
+			move_slab(cachep->slabs, cachep->numSlabs, slab, EMPTY);
+			slab = next;
 		}
 	}
 	cachep->sizeChange = 0;
-	kmem_cache_shrink(cachep);
-
 	LeaveCriticalSection(&cachep->lock);
+
+	kmem_cache_shrink(cachep);
 	DeleteCriticalSection(&cachep->lock);
+	DeleteCriticalSection(&cachep->depotLock);
+	for (int i = 0; i < MAGAZINE_SLOTS; i++) {
+		DeleteCriticalSection(&cachep->cpus[i].lock);
+	}
 
 	kmem_cache_free(object_cache, cachep);
 	cachep = NULL;
 }
 
+void register_cache(kmem_cache_t* cachep)
+{
+	EnterCriticalSection(&cacheListLock);
+	cachep->prevCache = NULL;
+	cachep->nextCache = cacheList;
+	if (cacheList) cacheList->prevCache = cachep;
+	cacheList = cachep;
+	LeaveCriticalSection(&cacheListLock);
+}
+
+void unregister_cache(kmem_cache_t* cachep)
+{
+	EnterCriticalSection(&cacheListLock);
+	if (cachep->prevCache) cachep->prevCache->nextCache = cachep->nextCache;
+	else if (cacheList == cachep) cacheList = cachep->nextCache;
+	if (cachep->nextCache) cachep->nextCache->prevCache = cachep->prevCache;
+	cachep->nextCache = cachep->prevCache = NULL;
+	LeaveCriticalSection(&cacheListLock);
+}
+
+void kmem_cache_set_retain(kmem_cache_t* cachep, size_t slabs)
+{
+	if (!cachep || !claim_cache(cachep)) return;
+	EnterCriticalSection(&cachep->lock);
+	cachep->retainSlabs = slabs;
+	LeaveCriticalSection(&cachep->lock);
+}
+
+size_t kmem_reclaim()
+{
+	if (inReclaim || noReclaim || !buffer_cache) return 0;
+	inReclaim = 1;
+
+	size_t cnt = 0;
+	shrinker_t local[MAX_SHRINKERS];
+	EnterCriticalSection(&cacheListLock);
+	kmem_cache_t* cachep = cacheList;
+	if (cachep) cachep->refCount++;
+	for (int i = 0; i < MAX_SHRINKERS; i++) {
+		local[i] = shrinkers[i];
+	}
+	LeaveCriticalSection(&cacheListLock);
+
+	while (cachep) {
+		slab_head* released = NULL;
+		cnt += cache_reclaim(cachep, &released);
+		release_slabs(released, cachep->dtor);
+
+		EnterCriticalSection(&cacheListLock);
+		kmem_cache_t* next = cachep->nextCache;
+		if (next) next->refCount++;
+		LeaveCriticalSection(&cacheListLock);
+		kmem_cache_destroy(cachep);
+		cachep = next;
+	}
+	for (int i = 0; i < NUM_BUFFER_CACHES; i++) {
+		slab_head* released = NULL;
+		cnt += buffer_cache_reclaim(&buffer_cache[i], &released);
+		release_slabs(released, NULL);
+	}
+
+	for (int i = 0; i < MAX_SHRINKERS; i++) {
+		if (local[i].shrink) cnt += local[i].shrink(local[i].arg);
+	}
+
+	inReclaim = 0;
+	return cnt;
+}
+
+int cache_reclaim(kmem_cache_t* cachep, slab_head** released)
+{
+	magazine_flush(cachep, 0);
+	if (!TryEnterCriticalSection(&cachep->lock)) return 0;
+	cachep->numObjects -= collect_remote(cachep->slabs, cachep->numSlabs, &cachep->remoteSlabs);
+	int cnt = release_empty_slabs(cachep->slabs, cachep->numSlabs, cachep->retainSlabs, released);
+	InterlockedExchangeAdd64(&cache_stats(cachep)->slabsDestroyed, cnt);
+	LeaveCriticalSection(&cachep->lock);
+	return cnt;
+}
+
+int buffer_cache_reclaim(buffer_cache_t* cachep, slab_head** released)
+{
+	if (!TryEnterCriticalSection(&cachep->lock)) return 0;
+	collect_remote(cachep->slabs, cachep->numSlabs, &cachep->remoteSlabs);
+	int cnt = release_empty_slabs(cachep->slabs, cachep->numSlabs, cachep->retainSlabs, released);
+	InterlockedExchangeAdd64(&cachep->stats.slabsDestroyed, cnt);
+	LeaveCriticalSection(&cachep->lock);
+	return cnt;
+}
+
+int kmem_register_shrinker(size_t (*shrink)(void*), void* arg)
+{
+	int id = -1;
+	EnterCriticalSection(&cacheListLock);
+	for (int i = 0; i < MAX_SHRINKERS; i++) {
+		if (!shrinkers[i].shrink) {
+			shrinkers[i].shrink = shrink;
+			shrinkers[i].arg = arg;
+			id = i;
+			break;
+		}
+	}
+	LeaveCriticalSection(&cacheListLock);
+	return id;
+}
+
+void kmem_unregister_shrinker(int id)
+{
+	if (id < 0 || id >= MAX_SHRINKERS) return;
+	EnterCriticalSection(&cacheListLock);
+	shrinkers[id].shrink = NULL;
+	shrinkers[id].arg = NULL;
+	LeaveCriticalSection(&cacheListLock);
+}
+
 void kmem_cache_info(kmem_cache_t* cachep)
 {
-	EnterCriticalSection(&object_cache->lock);
-	int numOfBlocks = 0, maxObjects= 0, freeObjects = 0;
-	int numOfSlabs = 0;
+	EnterCriticalSection(&cachep->lock);
+	int numOfBlocks = 0, maxObjects = 0, numOfObjects = (int)cachep->numObjects;
+	int numOfSlabs = (int)(cachep->numSlabs[EMPTY] + cachep->numSlabs[AVAILABLE] + cachep->numSlabs[FULL]);
 	for (int i = 0; i < 3; i++) {
 		slab_head* slab = cachep->slabs[i];
-		while (slab) {
-			numOfSlabs++;
-			maxObjects += slab->numOfSlots;
-			freeObjects += slab->numFreeSlots;
-			numOfBlocks += (slab->slabSize / BLOCK_SIZE);
-			slab = slab->next;
+		if (slab) {
+			maxObjects = numOfSlabs * slab->numOfSlots;
+			numOfBlocks = numOfSlabs * (slab->slabSize / BLOCK_SIZE);
+			break;
 		}
 	}
-	LeaveCriticalSection(&object_cache->lock);
+	LeaveCriticalSection(&cachep->lock);
 	printf_s("Cache info\nName: %s\nObject size: %d\nNum blocks: %d\nNumber slabs: %d\nNumber objects: %d\nPercentage: %f \n",
-		cachep->name, cachep->size, numOfBlocks, numOfSlabs, maxObjects - freeObjects, ((double)maxObjects - freeObjects) / maxObjects * 100);
+		cachep->name, cachep->size, numOfBlocks, numOfSlabs, numOfObjects, (double)numOfObjects / maxObjects * 100);
+}
+
+kmem_counters_t* cache_stats(kmem_cache_t* cachep)
+{
+	return &local_cpu_cache(cachep)->stats;
+}
+
+void lock_counted(CRITICAL_SECTION* lock, kmem_counters_t* stats)
+{
+	if (!TryEnterCriticalSection(lock)) {
+		InterlockedIncrement64(&stats->contentions);
+		EnterCriticalSection(lock);
+	}
+}
+
+int kmem_stats_snapshot(kmem_stats_t* table, int max)
+{
+	int n = 0;
+	EnterCriticalSection(&cacheListLock);
+	for (kmem_cache_t* cachep = cacheList; cachep; cachep = cachep->nextCache, n++) {
+		if (!table || n >= max) continue;
+		kmem_counters_t sum;
+		memset(&sum, 0, sizeof(sum));
+		for (int i = 0; i < MAGAZINE_SLOTS; i++) {
+			kmem_counters_t* c = &cachep->cpus[i].stats;
+			sum.allocs += c->allocs;
+			sum.frees += c->frees;
+			sum.fastHits += c->fastHits;
+			sum.slabsCreated += c->slabsCreated;
+			sum.slabsDestroyed += c->slabsDestroyed;
+			sum.contentions += c->contentions;
+		}
+		fill_stats(&table[n], cachep->name, cachep->size, &cachep->layout, cachep->numSlabs, &sum);
+	}
+	LeaveCriticalSection(&cacheListLock);
+
+	for (int i = 0; buffer_cache && i < NUM_BUFFER_CACHES; i++, n++) {
+		if (!table || n >= max) continue;
+		fill_stats(&table[n], bufferNames[i], buffer_cache[i].size, &buffer_cache[i].layout, buffer_cache[i].numSlabs, &buffer_cache[i].stats);
+	}
+	return n;
+}
+
+void fill_stats(kmem_stats_t* row, const char* name, size_t size, const slab_layout_t* layout, const size_t* numSlabs, const kmem_counters_t* counters)
+{
+	row->name = name;
+	row->objectSize = size;
+	row->stride = layout->objectSize;
+	row->slabSize = layout->slabSize;
+	row->numSlabs = numSlabs[EMPTY] + numSlabs[AVAILABLE] + numSlabs[FULL];
+	row->totalObjects = row->numSlabs * layout->numOfSlots;
+	row->allocs = counters->allocs;
+	row->frees = counters->frees;
+	row->fastHits = counters->fastHits;
+	row->slabsCreated = counters->slabsCreated;
+	row->slabsDestroyed = counters->slabsDestroyed;
+	row->contentions = counters->contentions;
+	row->activeObjects = (row->allocs > row->frees) ? (size_t)(row->allocs - row->frees) : 0;
+
+	size_t used = row->activeObjects * size, total = row->numSlabs * row->slabSize;
+	row->bytesWasted = (total > used) ? total - used : 0;
 }
 
 int kmem_cache_error(kmem_cache_t* cachep)
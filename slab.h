@@ -9,27 +9,97 @@ typedef enum SLAB_TYPE {
 	FULL = 2
 } SlabType;
 
+#define PARTIAL_BUCKETS 4
+#define PARTIAL_LIST 3 // Partial slabs live in PARTIAL_BUCKETS lists by occupancy, slabs[AVAILABLE] is the fullest of them
+#define NUM_SLAB_LISTS (PARTIAL_LIST + PARTIAL_BUCKETS)
+
 typedef struct slab_head_struct {
 	struct slab_head_struct* next;
+	struct slab_head_struct* prev;
+	void* cache;
+	void* base;
 	size_t numFreeSlots;
 	void* memmoryStart;
 	size_t slabSize;
 	size_t numOfSlots;
 	size_t objectSize;
 	SlabType type;
-	uint8_t* freeSlots;
+	int list;
+	uint16_t firstFree;
+	uint16_t* nextFree;
+	int owner;
+	volatile LONG remoteFree;
+	volatile LONG remoteQueued;
+	volatile LONG remoteBusy;
+	struct slab_head_struct* remoteNext;
 } slab_head;
 
+typedef struct magazine_s {
+	struct magazine_s* next;
+	int rounds;
+	int size;
+	void* objs[];
+} magazine_t;
+
+typedef struct kmem_counters_s {
+	volatile LONG64 allocs;
+	volatile LONG64 frees;
+	volatile LONG64 fastHits;
+	volatile LONG64 slabsCreated;
+	volatile LONG64 slabsDestroyed;
+	volatile LONG64 contentions;
+} kmem_counters_t;
+
+typedef struct __declspec(align(64)) cpu_cache_s { // Padded to CACHE_L1_LINE_SIZE so slots never share a line
+	CRITICAL_SECTION lock;
+	magazine_t* loaded;
+	magazine_t* previous;
+	kmem_counters_t stats;
+} cpu_cache_t;
+
+#define MAGAZINE_SLOTS 16
+#define CACHE_NAME_SIZE 32
+#define MAX_MAGAZINES (2 * MAGAZINE_SLOTS + 8) // Loaded and previous for every slot plus a small depot
+
+typedef struct slab_layout_s {
+	size_t objectSize;
+	size_t align;
+	size_t slabSize;
+	size_t numOfSlots;
+	boolean offSlab;
+} slab_layout_t;
+
+#define SLAB_HWCACHE_ALIGN 0x1
+#define SLAB_NO_FALSE_SHARING 0x2
+#define SLAB_NO_MERGE 0x4
+
 typedef struct kmem_cache_s {
 	CRITICAL_SECTION lock;
 	char* error;
-	char* name;
+	char name[CACHE_NAME_SIZE];
 	size_t size;
 	void (*ctor)(void*);
 	void (*dtor)(void*);
 	boolean sizeChange;
-	slab_head* slabs[3];
+	slab_head* slabs[NUM_SLAB_LISTS];
+	size_t numSlabs[NUM_SLAB_LISTS];
+	size_t numObjects;
 	size_t l1;
+	size_t colorStride;
+	slab_layout_t layout;
+	int flags;
+	void* lastSlab;
+	slab_head* volatile remoteSlabs;
+	int magSize;
+	CRITICAL_SECTION depotLock;
+	magazine_t* fullMags;
+	magazine_t* emptyMags;
+	volatile LONG numMags;
+	cpu_cache_t cpus[MAGAZINE_SLOTS];
+	size_t retainSlabs;
+	int refCount;
+	struct kmem_cache_s* nextCache;
+	struct kmem_cache_s* prevCache;
 } kmem_cache_t;
 
 typedef struct buffer_cache_s {
@@ -37,51 +107,223 @@ typedef struct buffer_cache_s {
 	char* error;
 	size_t size;
 	boolean sizeChange;
-	slab_head* slabs[3];
+	slab_head* slabs[NUM_SLAB_LISTS];
+	size_t numSlabs[NUM_SLAB_LISTS];
 	size_t l1;
+	slab_layout_t layout;
+	void* lastSlab;
+	slab_head* volatile remoteSlabs;
+	size_t retainSlabs;
+	kmem_counters_t stats;
 } buffer_cache_t;
 
+typedef struct kmem_stats_s {
+	const char* name;
+	size_t objectSize;
+	size_t stride;
+	size_t slabSize;
+	size_t numSlabs;
+	size_t activeObjects;
+	size_t totalObjects;
+	size_t bytesWasted; // Slab bytes not holding live object data
+	LONG64 allocs;
+	LONG64 frees;
+	LONG64 fastHits;
+	LONG64 slabsCreated;
+	LONG64 slabsDestroyed;
+	LONG64 contentions;
+} kmem_stats_t;
+
+typedef struct shrinker_s {
+	size_t (*shrink)(void* arg);
+	void* arg;
+} shrinker_t;
+
 #define BLOCK_SIZE (4096)
 #define CACHE_L1_LINE_SIZE (64)
 #define MAX_BUFFER_SIZE 17
 #define MIN_BUFFER_SIZE 5
+#define NUM_BUFFER_CACHES (2 * (MAX_BUFFER_SIZE - MIN_BUFFER_SIZE) + 1)
+#define SMALL_CLASS_LIMIT 512
+#define LARGE_ALLOC 0x1
+#define SLAB_END 0xFFFF
+#define MAX_ARENAS 16
+#define NUM_OF_ARENAS 4
+#define MIN_ARENA_BLOCKS 256
+#define MAX_SLAB_ORDER 3
+#define OFF_SLAB_MIN (BLOCK_SIZE / 8)
+#define MAX_SHRINKERS 16
+#define DEFAULT_RETAIN_SLABS 1
 
-buddy_head* buddy;
+buddy_head* arenas[MAX_ARENAS];
+int numOfArenas;
 buffer_cache_t* buffer_cache;
 kmem_cache_t* object_cache;
+kmem_cache_t* cacheList;
+CRITICAL_SECTION cacheListLock;
+shrinker_t shrinkers[MAX_SHRINKERS];
 
 void kmem_init(void* space, int block_num);
 
-void initialize_cache(kmem_cache_t* cache, const char* name, size_t size, void(*ctor)(void*), void(*dtor)(void*));
+int arena_count(int block_num, int num_arenas);
+
+void kmem_init_arenas(void* space, int block_num, int num_arenas, int flags); // Split space into independent buddy arenas
+
+void kmem_init_reserved(int block_num, int num_arenas, int release_order, int flags); // Arenas backed by reserved address space, see buddy_reserve
+
+void initialize_kmem();
+
+void kmem_bind_arena(int id); // Pin calling thread to one arena, -1 restores default
+
+void* arena_alloc(size_t size);
+
+void* arena_alloc_near(size_t size, void* hint);
+
+buddy_head* find_arena(const void* memptr);
+
+void arena_free(void* memptr, size_t size);
+
+void arena_set_owner(void* memptr, size_t size, void* owner);
+
+boolean arena_extend(void* memptr, size_t oldSize, size_t newSize);
+
+void* arena_owner(const void* memptr);
+
+void initialize_cache(kmem_cache_t* cache, const char* name, size_t size, size_t align, int flags, void(*ctor)(void*), void(*dtor)(void*));
+
+int default_magazine_size(size_t size);
 
 void initialize_buffer_head();
 
 kmem_cache_t * kmem_cache_create(const char* name, size_t size,void (*ctor)(void*),void (*dtor)(void*)); // Allocate cache
 
+kmem_cache_t* kmem_cache_create_aligned(const char* name, size_t size, size_t align, int flags, void (*ctor)(void*), void (*dtor)(void*)); // Allocate cache, align 0 keeps natural alignment
+
+size_t cache_alignment(size_t size, size_t align, int flags);
+
+kmem_cache_t* find_mergeable(size_t size, size_t align); // Registered cache with the same object layout and no ctor/dtor, caller holds cacheListLock
+int claim_cache(kmem_cache_t* cachep); // Marks the cache unmergeable before tuning, 0 if it is already shared
+
 int kmem_cache_shrink(kmem_cache_t * cachep); // Shrink cache
 
 void* kmem_cache_alloc(kmem_cache_t * cachep); // Allocate one object from cache
 
-void create_slab(slab_head** slabs, size_t objectSize, size_t*l1);
+void* slab_alloc(kmem_cache_t* cachep);
+
+int kmem_cache_alloc_bulk(kmem_cache_t* cachep, size_t nr, void** p); // Allocate nr objects under one lock, returns nr or 0
+
+void kmem_cache_free_bulk(kmem_cache_t* cachep, size_t nr, void** p); // Deallocate nr objects, p is sorted in place
+
+size_t free_runs(kmem_cache_t* cachep, size_t nr, void** p); // Free sorted objects slab by slab, cache lock held, returns number freed
+
+size_t slab_alloc_run(slab_head** slabs, size_t* numSlabs, slab_head* slab, size_t nr, void** p);
+
+size_t slab_free_run(slab_head** slabs, size_t* numSlabs, slab_head* slab, size_t nr, void** p);
+
+int compare_objects(const void* a, const void* b);
+
+size_t slab_meta_size(size_t num, size_t align);
+
+size_t slab_objects(size_t size, size_t objectSize, size_t align, boolean offSlab);
+
+void slab_geometry(slab_layout_t* layout, size_t size, size_t align); // Pick slab size and metadata placement with the least waste
+
+void create_slab(void* cache, slab_head** slabs, size_t* numSlabs, const slab_layout_t* layout, size_t*l1, size_t colorStride, void** lastSlab, void (*ctor)(void*));
+
+void release_slab(slab_head* slab, void (*dtor)(void*));
 
 void* alloc_one_object(slab_head* slab);
 
+void free_one_object(slab_head* slab, const void* objp);
+
+void reset_free_list(slab_head* slab);
+
+void remote_free(slab_head* volatile* remoteSlabs, slab_head* slab, const void* objp); // Lock-free free from a thread that does not own the slab
+
+size_t collect_remote(slab_head** slabs, size_t* numSlabs, slab_head* volatile* remoteSlabs); // Take back remotely freed objects, cache lock held
+
+int release_empty_slabs(slab_head** slabs, size_t* numSlabs, size_t keep, slab_head** released); // Unlink empty slabs onto released, cache lock held
+
+void release_slabs(slab_head* slab, void (*dtor)(void*)); // Return a released list to the arenas, no cache lock held
+
 void kmem_cache_free(kmem_cache_t * cachep, void* objp); // Deallocate one object from cache
 
-void move_slab(slab_head** slabs, slab_head* slab, SlabType t2);
+void slab_free(kmem_cache_t* cachep, slab_head* slab, void* objp);
+
+cpu_cache_t* local_cpu_cache(kmem_cache_t* cachep);
+
+void* magazine_alloc(kmem_cache_t* cachep);
+
+boolean magazine_free(kmem_cache_t* cachep, void* objp);
+
+void magazine_empty(kmem_cache_t* cachep, magazine_t* mag);
+
+void magazine_flush(kmem_cache_t* cachep, boolean all);
+
+void kmem_cache_set_magazine(kmem_cache_t* cachep, int size); // Rounds per magazine, 0 disables the magazine layer, refused on a shared cache
+
+void kmem_cache_set_color(kmem_cache_t* cachep, size_t stride); // Color offset step between slabs, 0 disables coloring, refused on a shared cache
+
+void update_slab(slab_head** slabs, size_t* numSlabs, slab_head* slab); // Relink slab into the list matching its occupancy
+
+int slab_list(const slab_head* slab, SlabType t);
+
+slab_head* fullest_partial(slab_head** slabs);
+
+void move_slab(slab_head** slabs, size_t* numSlabs, slab_head* slab, SlabType t2);
+
+void link_slab(slab_head** slabs, size_t* numSlabs, slab_head* slab, SlabType t);
+
+void unlink_slab(slab_head** slabs, size_t* numSlabs, slab_head* slab);
 
 int buffer_cache_shrink(buffer_cache_t* cachep);
 
 void* kmalloc(size_t size); // Alloacate one small memory buffer
 
+int buffer_class(size_t size); // Index of the smallest buffer cache that fits size
+
+void* kmalloc_large(size_t size); // Pages straight from the arenas for requests above the largest class
+
+size_t large_size(const void* objp); // Size of a kmalloc_large block, 0 for anything else
+
 void kfree(const void* objp); // Deallocate one small memory buffer
 
-buffer_cache_t* find_buffer_cache(void* objp);
+void kfree_bulk(size_t nr, void** p); // Deallocate nr small memory buffers, p is sorted in place
+
+size_t ksize(const void* objp); // Usable size of a kmalloc buffer, 0 if objp was not allocated by kmalloc
+
+void* krealloc(const void* objp, size_t size); // Resize a kmalloc buffer, in place when it still fits or the pages after it are free
+
+buffer_cache_t* find_buffer_cache(const void* objp);
+
+slab_head* find_slab(const void* objp);
+
+void kmem_cache_destroy(kmem_cache_t* cachep); // Drop one reference, the last one deallocates the cache
+
+void register_cache(kmem_cache_t* cachep);
 
-slab_head* find_slab(slab_head** slabs, void* objp);
+void unregister_cache(kmem_cache_t* cachep);
 
-void kmem_cache_destroy(kmem_cache_t* cachep); // Deallocate cache
+void kmem_cache_set_retain(kmem_cache_t* cachep, size_t slabs); // Empty slabs kept through a reclaim pass, refused on a shared cache
+
+size_t kmem_reclaim(); // Release empty slabs of every cache and run shrinkers, returns amount released, does nothing under an allocator lock
+
+int cache_reclaim(kmem_cache_t* cachep, slab_head** released);
+
+int buffer_cache_reclaim(buffer_cache_t* cachep, slab_head** released);
+
+int kmem_register_shrinker(size_t (*shrink)(void*), void* arg); // Returns shrinker id or -1
+
+void kmem_unregister_shrinker(int id);
 
 void kmem_cache_info(kmem_cache_t* cachep); // Print cache info
 
+kmem_counters_t* cache_stats(kmem_cache_t* cachep);
+
+void lock_counted(CRITICAL_SECTION* lock, kmem_counters_t* stats);
+
+int kmem_stats_snapshot(kmem_stats_t* table, int max); // Fill up to max rows for all caches and buffer classes, returns number of rows
+
+void fill_stats(kmem_stats_t* row, const char* name, size_t size, const slab_layout_t* layout, const size_t* numSlabs, const kmem_counters_t* counters);
+
 int kmem_cache_error(kmem_cache_t* cachep); // Print error message